@@ -17,7 +17,9 @@
 
 #include <hidl/HidlSupport.h>
 
-#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
@@ -33,11 +35,197 @@ bool debuggable() {
     return false;
 #endif
 }
+
+// Consumes eight bytes per step; the memcpy()s compile to unaligned loads.
+// The multiplications are meant to wrap around.
+__attribute__((no_sanitize("unsigned-integer-overflow")))
+size_t hashString(const char *data, size_t size) {
+    constexpr uint64_t kMul = 0x9ddfea08eb382d69ULL;
+    uint64_t hash = size * kMul;
+    auto mix = [&hash](uint64_t word) {
+        hash = (hash ^ word) * kMul;
+        hash ^= hash >> 47;
+    };
+    for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        mix(word);
+    }
+    if (size > 0) {
+        uint64_t word = 0;
+        memcpy(&word, data, size);
+        mix(word);
+    }
+    return static_cast<size_t>(hash ^ (hash >> 32));
+}
+
 }  // namespace details
 
+namespace {
+constexpr size_t kArenaChunkSize = 16 * 1024;
+
+uintptr_t alignUp(uintptr_t pos, size_t alignment) {
+    return (pos + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1);
+}
+}  // namespace
+
+// Header of a hidl_arena chunk; its memory follows.
+struct hidl_arena::Chunk {
+    Chunk *next;  // previously allocated chunk
+    size_t size;  // including this header
+};
+
+hidl_arena::~hidl_arena() {
+    while (mChunks != nullptr) {
+        Chunk *next = mChunks->next;
+        free(mChunks);
+        mChunks = next;
+    }
+}
+
+void *hidl_arena::allocate(size_t size, size_t alignment) {
+    uintptr_t start = alignUp(mPos, alignment);
+    if (mChunks == nullptr || start < mPos || start > mEnd || size > mEnd - start) {
+        if (size > SIZE_MAX - sizeof(Chunk) - alignment) {
+            LOG(FATAL) << "hidl_arena allocation size overflows: " << size;
+        }
+        addChunk(std::max(kArenaChunkSize, sizeof(Chunk) + alignment + size));
+        start = alignUp(mPos, alignment);
+    }
+    mPos = start + size;
+    return reinterpret_cast<void *>(start);
+}
+
+// Free all chunks but the first one if it has the default size, and start
+// allocating from the beginning again.
+void hidl_arena::reset() {
+    while (mChunks != nullptr && mChunks->next != nullptr) {
+        Chunk *next = mChunks->next;
+        free(mChunks);
+        mChunks = next;
+    }
+    if (mChunks != nullptr && mChunks->size != kArenaChunkSize) {
+        free(mChunks);
+        mChunks = nullptr;
+    }
+    rewind();
+}
+
+void hidl_arena::addChunk(size_t size) {
+    Chunk *chunk = static_cast<Chunk *>(malloc(size));
+    if (chunk == nullptr) {
+        LOG(FATAL) << "Failed to allocate " << size << " bytes for hidl_arena";
+    }
+    chunk->next = mChunks;
+    chunk->size = size;
+    mChunks = chunk;
+    rewind();
+}
+
+void hidl_arena::rewind() {
+    if (mChunks == nullptr) {
+        mPos = mEnd = 0;
+        return;
+    }
+    mPos = reinterpret_cast<uintptr_t>(mChunks + 1);
+    mEnd = reinterpret_cast<uintptr_t>(mChunks) + mChunks->size;
+}
+
+namespace {
+
+struct SharedHandleSlot {
+    std::atomic<const native_handle_t *> handle;
+    std::atomic<size_t> refs;
+};
+
+// Process-local record of the handles passed to setToShared(). A hidl_handle
+// only keeps the id of its slot in padding, which the sender of a Parcel
+// controls, so the id is only believed if the slot holds the same handle.
+// Handles read from a Parcel point into the Parcel, so they never do. Slots
+// live in fixed segments that are never freed, so lookups take no lock.
+class SharedHandleRegistry {
+public:
+    SharedHandleRegistry() {
+        for (auto &segment : mSegments) {
+            segment.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns the id of a new slot for handle, with one reference.
+    uint32_t add(const native_handle_t *handle) {
+        std::unique_lock<std::mutex> _lock(mLock);
+        uint32_t index;
+        if (!mFree.empty()) {
+            index = mFree.back();
+            mFree.pop_back();
+        } else {
+            if (mNext == kSegmentSize * kMaxSegments) {
+                LOG(FATAL) << "Too many shared native_handles";
+            }
+            index = mNext++;
+            if (index % kSegmentSize == 0) {
+                SharedHandleSlot *segment = new SharedHandleSlot[kSegmentSize]();
+                mSegments[index / kSegmentSize].store(segment, std::memory_order_release);
+            }
+        }
+        SharedHandleSlot &slot = slotAt(index);
+        slot.refs.store(1, std::memory_order_relaxed);
+        slot.handle.store(handle, std::memory_order_release);
+        return index + 1;
+    }
+
+    // Returns the slot with the given id if it holds handle, else nullptr.
+    // The caller must hold a reference to handle, if it is shared at all.
+    SharedHandleSlot *find(uint32_t id, const native_handle_t *handle) const {
+        if (id == 0 || handle == nullptr || id > kSegmentSize * kMaxSegments) {
+            return nullptr;
+        }
+        uint32_t index = id - 1;
+        SharedHandleSlot *segment =
+                mSegments[index / kSegmentSize].load(std::memory_order_acquire);
+        if (segment == nullptr) {
+            return nullptr;
+        }
+        SharedHandleSlot &slot = segment[index % kSegmentSize];
+        return slot.handle.load(std::memory_order_acquire) == handle ? &slot : nullptr;
+    }
+
+    // Frees the slot with the given id once its last reference is gone.
+    void remove(uint32_t id) {
+        std::unique_lock<std::mutex> _lock(mLock);
+        slotAt(id - 1).handle.store(nullptr, std::memory_order_relaxed);
+        mFree.push_back(id - 1);
+    }
+
+private:
+    static constexpr uint32_t kSegmentSize = 256;
+    static constexpr uint32_t kMaxSegments = 4096;
+
+    SharedHandleSlot &slotAt(uint32_t index) {
+        return mSegments[index / kSegmentSize].load(std::memory_order_relaxed)
+                [index % kSegmentSize];
+    }
+
+    std::atomic<SharedHandleSlot *> mSegments[kMaxSegments];
+    std::mutex mLock;  // for adding and freeing slots
+    std::vector<uint32_t> mFree;
+    uint32_t mNext = 0;
+};
+
+SharedHandleRegistry &sharedHandles() {
+    // Never destroyed, since hidl_handles may outlive static destruction.
+    static SharedHandleRegistry *registry = new SharedHandleRegistry();
+    return *registry;
+}
+
+static_assert(sizeof(hidl_handle) == 16, "mShareId must fit in padding");
+
+}  // anonymous namespace
+
 hidl_handle::hidl_handle() {
     mHandle = nullptr;
     mOwnsHandle = false;
+    mShareId = 0;
 }
 
 hidl_handle::~hidl_handle() {
@@ -47,17 +235,20 @@ hidl_handle::~hidl_handle() {
 hidl_handle::hidl_handle(const native_handle_t *handle) {
     mHandle = handle;
     mOwnsHandle = false;
+    mShareId = 0;
 }
 
 // copy constructor.
 hidl_handle::hidl_handle(const hidl_handle &other) {
     mOwnsHandle = false;
+    mShareId = 0;
     *this = other;
 }
 
 // move constructor.
 hidl_handle::hidl_handle(hidl_handle &&other) {
     mOwnsHandle = false;
+    mShareId = 0;
     *this = std::move(other);
 }
 
@@ -66,6 +257,15 @@ hidl_handle &hidl_handle::operator=(const hidl_handle &other) {
     if (this == &other) {
         return *this;
     }
+    SharedHandleSlot *slot = sharedHandles().find(other.mShareId, other.mHandle);
+    if (slot != nullptr) {
+        slot->refs.fetch_add(1, std::memory_order_relaxed);
+        freeHandle();
+        mHandle = other.mHandle;
+        mOwnsHandle = false;
+        mShareId = other.mShareId;
+        return *this;
+    }
     freeHandle();
     if (other.mHandle != nullptr) {
         mHandle = native_handle_clone(other.mHandle);
@@ -92,8 +292,10 @@ hidl_handle &hidl_handle::operator=(hidl_handle &&other) {
         freeHandle();
         mHandle = other.mHandle;
         mOwnsHandle = other.mOwnsHandle;
+        mShareId = other.mShareId;
         other.mHandle = nullptr;
         other.mOwnsHandle = false;
+        other.mShareId = 0;
     }
     return *this;
 }
@@ -104,6 +306,15 @@ void hidl_handle::setTo(native_handle_t* handle, bool shouldOwn) {
     mOwnsHandle = shouldOwn;
 }
 
+void hidl_handle::setToShared(native_handle_t* handle) {
+    freeHandle();
+    mHandle = handle;
+    mOwnsHandle = false;
+    if (handle != nullptr) {
+        mShareId = sharedHandles().add(handle);
+    }
+}
+
 const native_handle_t* hidl_handle::operator->() const {
     return mHandle;
 }
@@ -119,6 +330,20 @@ const native_handle_t *hidl_handle::getNativeHandle() const {
 }
 
 void hidl_handle::freeHandle() {
+    SharedHandleSlot *slot = sharedHandles().find(mShareId, mHandle);
+    if (slot != nullptr) {
+        if (slot->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            native_handle_t *handle = const_cast<native_handle_t *>(
+                    static_cast<const native_handle_t *>(mHandle));
+            sharedHandles().remove(mShareId);
+            native_handle_close(handle);
+            native_handle_delete(handle);
+        }
+        mHandle = nullptr;
+        mShareId = 0;
+        return;
+    }
+    mShareId = 0;
     if (mOwnsHandle && mHandle != nullptr) {
         // This can only be true if:
         // 1. Somebody called setTo() with shouldOwn=true, so we know the handle
@@ -261,6 +486,21 @@ void hidl_string::setToExternal(const char *data, size_t size) {
     mOwnsBuffer = false;
 }
 
+void hidl_string::setToArena(const char *data, size_t size, hidl_arena &arena) {
+    if (size > UINT32_MAX) {
+        LOG(FATAL) << "string size can't exceed 2^32 bytes: " << size;
+    }
+    clear();
+
+    // The arena releases the copy, so it isn't owned.
+    char *buf = static_cast<char *>(arena.allocate(size + 1, 1 /* alignment */));
+    memcpy(buf, data, size);
+    buf[size] = '\0';
+    mBuffer = buf;
+    mSize = static_cast<uint32_t>(size);
+    mOwnsBuffer = false;
+}
+
 const char *hidl_string::c_str() const {
     return mBuffer;
 }
@@ -15,39 +15,375 @@
  */
 
 #include <hidl/TaskRunner.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
 
 namespace android {
 namespace hardware {
 namespace details {
 
+constexpr size_t TaskRunner::kInlineTaskSize;
+constexpr std::chrono::milliseconds TaskRunner::kDefaultIdleTimeout;
+
+class TaskRunner::Impl {
+public:
+    virtual ~Impl() {}
+    virtual bool push(Task &&t) = 0;
+    virtual bool push(uint64_t key, Task &&t) = 0;
+    // Let the workers exit once they have run all queued tasks.
+    virtual void stop() = 0;
+};
+
+// A single thread running the tasks of a SynchronizedQueue or
+// BoundedMpscQueue in order. The thread is started by the first push and
+// exits once the queue has been empty for idleTimeout; the next push starts
+// another one.
+template <typename Queue>
+class TaskRunner::SerialImpl : public TaskRunner::Impl,
+                               public std::enable_shared_from_this<SerialImpl<Queue>> {
+public:
+    SerialImpl(size_t limit, std::chrono::nanoseconds idleTimeout)
+        : mQueue(limit), mIdleTimeout(idleTimeout) {}
+
+    bool push(Task &&t) override {
+        if (!mQueue.push(std::move(t))) {
+            return false;
+        }
+        ensureRunning();
+        return true;
+    }
+
+    // Tasks run one at a time anyway.
+    bool push(uint64_t /* key */, Task &&t) override {
+        return push(std::move(t));
+    }
+
+    void stop() override {
+        // Nothing left to run and no thread to end.
+        if (!mRunning.load() && mQueue.size() == 0) {
+            return;
+        }
+        // If the queue is full, the thread ends once it has been idle.
+        push(nullptr);
+    }
+
+private:
+    // Tasks taken from the queue at a time.
+    static constexpr size_t kBatchSize = 32;
+
+    void ensureRunning() {
+        // Sequentially consistent with the store in loop(): either the thread
+        // sees the task that was just queued before exiting, or we see that
+        // it exits and start another one.
+        if (mRunning.load() || mRunning.exchange(true)) {
+            return;
+        }
+        // Allow the thread to continue running in background;
+        // TaskRunner do not care about the std::thread object.
+        std::thread{[self = this->shared_from_this()] { self->loop(); }}.detach();
+    }
+
+    size_t drain(std::vector<Task> *batch) {
+        if (mIdleTimeout == std::chrono::nanoseconds::max()) {
+            return mQueue.drain(batch, kBatchSize);
+        }
+        return mQueue.drain_for(batch, kBatchSize, mIdleTimeout);
+    }
+
+    void loop() {
+        std::vector<Task> batch;
+        for (;;) {
+            if (drain(&batch) == 0) {
+                mRunning.store(false);
+                // A push may have come in after the timeout and seen this
+                // thread still running.
+                if (mQueue.size() == 0 || mRunning.exchange(true)) {
+                    return;
+                }
+                continue;
+            }
+            for (Task &queued : batch) {
+                Task nextTask = std::move(queued);
+                if (!nextTask) {
+                    mRunning.store(false);
+                    return;
+                }
+                nextTask();
+            }
+            batch.clear();
+        }
+    }
+
+    Queue mQueue;
+    const std::chrono::nanoseconds mIdleTimeout;
+    std::atomic<bool> mRunning{false};
+};
+
+// Several threads, each with a queue of its own. Workers run the tasks of
+// their own queue first, then steal the oldest tasks of other workers, and
+// wait when there is nothing left. Like SerialImpl's thread, they are
+// started by pushes, up to workerCount while none is waiting, and exit once
+// they have waited for idleTimeout. Tasks with a key are kept in a per-key
+// queue instead, of which at most one task is in the workers' queues at a
+// time.
+class TaskRunner::PoolImpl : public TaskRunner::Impl,
+                             public std::enable_shared_from_this<TaskRunner::PoolImpl> {
+public:
+    PoolImpl(size_t limit, size_t workerCount, std::chrono::nanoseconds idleTimeout)
+        : mLimit(limit),
+          mWorkerCount(workerCount),
+          mIdleTimeout(idleTimeout),
+          mWorkers(new Worker[workerCount]) {}
+
+    bool push(Task &&t) override {
+        if (!reserve()) {
+            return false;
+        }
+        enqueue(std::move(t), true /* counted */);
+        return true;
+    }
+
+    bool push(uint64_t key, Task &&t) override {
+        if (!reserve()) {
+            return false;
+        }
+        bool idle;
+        {
+            std::lock_guard<std::mutex> lock(mStrandsLock);
+            std::deque<Task> &tasks = mStrands[key];
+            idle = tasks.empty();
+            tasks.push_back(std::move(t));
+        }
+        if (idle) {
+            postStrand(key);
+        }
+        return true;
+    }
+
+    void stop() override {
+        {
+            std::lock_guard<std::mutex> lock(mIdleLock);
+            mStopping = true;
+        }
+        mIdleCondition.notify_all();
+    }
+
+private:
+    struct Entry {
+        Task task;
+        bool counted;  // in mPending
+    };
+
+    struct Worker {
+        std::mutex lock;
+        std::deque<Entry> tasks;
+    };
+
+    static thread_local PoolImpl *tCurrentPool;
+    static thread_local size_t tCurrentWorker;
+
+    // Count a task that hasn't started yet against the limit, whether it has
+    // a key or not.
+    bool reserve() {
+        if (mPending.fetch_add(1) >= mLimit) {
+            mPending.fetch_sub(1);
+            return false;
+        }
+        return true;
+    }
+
+    void enqueue(Task &&t, bool counted) {
+        mQueued.fetch_add(1);
+
+        // Tasks pushed by a worker stay with it; others are spread out.
+        size_t index = tCurrentPool == this ? tCurrentWorker : mNext++ % mWorkerCount;
+        {
+            std::lock_guard<std::mutex> lock(mWorkers[index].lock);
+            mWorkers[index].tasks.push_back(Entry{std::move(t), counted});
+        }
+
+        // A worker about to wait or exit checks mQueued after announcing it
+        // in mIdleWorkers or mRunningWorkers, so either it sees the task or
+        // we see it here.
+        if (mIdleWorkers.load() > 0) {
+            { std::lock_guard<std::mutex> lock(mIdleLock); }
+            mIdleCondition.notify_one();
+        } else if (addRunningWorker()) {
+            std::thread{[pool = shared_from_this()] { pool->loop(); }}.detach();
+        }
+    }
+
+    // Returns false if workerCount workers are running already.
+    bool addRunningWorker() {
+        size_t running = mRunningWorkers.load();
+        while (running < mWorkerCount) {
+            if (mRunningWorkers.compare_exchange_weak(running, running + 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool take(size_t self, Entry *entry) {
+        for (size_t i = 0; i < mWorkerCount; ++i) {
+            Worker &worker = mWorkers[(self + i) % mWorkerCount];
+            std::lock_guard<std::mutex> lock(worker.lock);
+            if (!worker.tasks.empty()) {
+                *entry = std::move(worker.tasks.front());
+                worker.tasks.pop_front();
+                mQueued.fetch_sub(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Returns false if nothing was queued before the pool stopped or
+    // mIdleTimeout passed.
+    bool waitForTask() {
+        std::unique_lock<std::mutex> lock(mIdleLock);
+        // mQueued counts tasks that are still being added to a queue too.
+        auto ready = [this] { return mQueued.load() > 0 || mStopping; };
+        if (!ready()) {
+            ++mIdleWorkers;
+            if (mIdleTimeout == std::chrono::nanoseconds::max()) {
+                mIdleCondition.wait(lock, ready);
+            } else {
+                mIdleCondition.wait_for(lock, mIdleTimeout, ready);
+            }
+            --mIdleWorkers;
+        }
+        return mQueued.load() > 0;
+    }
+
+    void loop() {
+        tCurrentPool = this;
+        tCurrentWorker = mNextWorker++ % mWorkerCount;
+        for (;;) {
+            Entry entry;
+            if (take(tCurrentWorker, &entry)) {
+                if (entry.counted) {
+                    mPending.fetch_sub(1);
+                }
+                entry.task();
+                continue;
+            }
+            if (waitForTask()) {
+                continue;
+            }
+            mRunningWorkers.fetch_sub(1);
+            // A push may have come in meanwhile and seen this worker running.
+            if (mQueued.load() == 0 || !addRunningWorker()) {
+                break;
+            }
+        }
+        tCurrentPool = nullptr;
+    }
+
+    // Queue a task running the oldest task of the given key. It isn't
+    // counted in mPending; the keyed task is until it starts.
+    void postStrand(uint64_t key) {
+        enqueue([pool = shared_from_this(), key] { pool->runStrand(key); },
+                false /* counted */);
+    }
+
+    void runStrand(uint64_t key) {
+        // The task stays at the front, moved from, until it finished so that
+        // pushes for this key don't post another runStrand meanwhile.
+        Task task;
+        {
+            std::lock_guard<std::mutex> lock(mStrandsLock);
+            task = std::move(mStrands.find(key)->second.front());
+        }
+        mPending.fetch_sub(1);
+        task();
+        bool more;
+        {
+            std::lock_guard<std::mutex> lock(mStrandsLock);
+            auto it = mStrands.find(key);
+            it->second.pop_front();
+            more = !it->second.empty();
+            if (!more) {
+                mStrands.erase(it);
+            }
+        }
+        // Post the next task rather than running it here, to take turns with
+        // the other tasks.
+        if (more) {
+            postStrand(key);
+        }
+    }
+
+    const size_t mLimit;
+    const size_t mWorkerCount;
+    const std::chrono::nanoseconds mIdleTimeout;
+    std::unique_ptr<Worker[]> mWorkers;
+    std::atomic<size_t> mPending{0};  // pushed tasks that haven't started
+    std::atomic<size_t> mQueued{0};   // entries in all workers' queues
+    std::atomic<size_t> mNext{0};
+    std::atomic<size_t> mNextWorker{0};
+    std::atomic<size_t> mRunningWorkers{0};
+
+    std::mutex mIdleLock;
+    std::condition_variable mIdleCondition;
+    std::atomic<size_t> mIdleWorkers{0};  // only modified with mIdleLock held
+    bool mStopping = false;
+
+    std::mutex mStrandsLock;
+    std::unordered_map<uint64_t, std::deque<Task>> mStrands;
+};
+
+thread_local TaskRunner::PoolImpl *TaskRunner::PoolImpl::tCurrentPool = nullptr;
+thread_local size_t TaskRunner::PoolImpl::tCurrentWorker = 0;
+
 TaskRunner::TaskRunner() {
 }
 
+void TaskRunner::setIdleTimeout(std::chrono::nanoseconds timeout) {
+    mIdleTimeout = timeout;
+}
+
 void TaskRunner::start(size_t limit) {
-    mQueue = std::make_shared<SynchronizedQueue<Task>>(limit);
+    start(limit, 1 /* workerCount */);
+}
 
-    // Allow the thread to continue running in background;
-    // TaskRunner do not care about the std::thread object.
-    std::thread{[q = mQueue] {
-        Task nextTask;
-        while (!!(nextTask = q->wait_pop())) {
-            nextTask();
-        }
-    }}.detach();
+void TaskRunner::start(size_t limit, size_t workerCount) {
+    if (mImpl) {
+        mImpl->stop();
+    }
+    if (workerCount <= 1) {
+        mImpl = std::make_shared<SerialImpl<SynchronizedQueue<Task>>>(limit, mIdleTimeout);
+        return;
+    }
+    mImpl = std::make_shared<PoolImpl>(limit, workerCount, mIdleTimeout);
+}
+
+void TaskRunner::startLockFree(size_t limit) {
+    if (mImpl) {
+        mImpl->stop();
+    }
+    mImpl = std::make_shared<SerialImpl<BoundedMpscQueue<Task>>>(limit, mIdleTimeout);
 }
 
 TaskRunner::~TaskRunner() {
-    if (mQueue) {
-        mQueue->push(nullptr);
+    if (mImpl) {
+        mImpl->stop();
     }
 }
 
-bool TaskRunner::push(const Task &t) {
-    return (mQueue != nullptr) && (!!t) && this->mQueue->push(t);
+bool TaskRunner::push(Task &&t) {
+    return (mImpl != nullptr) && (!!t) && mImpl->push(std::move(t));
+}
+
+bool TaskRunner::push(uint64_t key, Task &&t) {
+    return (mImpl != nullptr) && (!!t) && mImpl->push(key, std::move(t));
 }
 
 } // namespace details
 } // namespace hardware
 } // namespace android
-
@@ -32,6 +32,11 @@ namespace details {
 //to avoid creating dependencies on liblog.
 void logAlwaysFatal(const char *message);
 
+// Selects the constexpr constructors of hidl_pointer and hidl_string, which
+// reference data with static storage duration.
+struct static_storage_t {};
+constexpr static_storage_t kStaticStorage{};
+
 // HIDL client/server code should *NOT* use this class.
 //
 // hidl_pointer wraps a pointer without taking ownership,
@@ -45,6 +50,10 @@ struct hidl_pointer {
         : _pad(0) {
     }
     hidl_pointer(T* ptr) : hidl_pointer() { mPointer = ptr; }
+    // Usable for constant initialization. In 32-bit processes the upper half
+    // of _pad is left unset; the binder driver overwrites all 64 bits of
+    // embedded pointers anyway.
+    constexpr hidl_pointer(T* ptr, static_storage_t) : mPointer(ptr) {}
     hidl_pointer(const hidl_pointer<T>& other) : hidl_pointer() { mPointer = other.mPointer; }
     hidl_pointer(hidl_pointer<T>&& other) : hidl_pointer() { *this = std::move(other); }
 
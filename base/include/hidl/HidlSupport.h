@@ -20,12 +20,19 @@
 #include <algorithm>
 #include <array>
 #include <iterator>
+#include <limits>
 #include <cutils/native_handle.h>
 #include <hidl/HidlInternal.h>
 #include <hidl/Status.h>
 #include <map>
+#include <new>
 #include <sstream>
 #include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 #include <tuple>
 #include <type_traits>
 #include <utils/Errors.h>
@@ -60,6 +67,46 @@ namespace details {
 bool debuggable();
 } //  namespace details
 
+// Bump allocator for the hidl_strings and hidl_vecs built for a single call,
+// e.g. a reply handed to a callback. Only objects explicitly placed in it
+// with setToArena() or resize(size, arena) use it. Like setToExternal(),
+// they reference its memory without owning it, and all of that memory is
+// released at once by reset() or the destructor, so declare the arena before
+// the objects:
+//     Return<void> Foo::getInfo(getInfo_cb _hidl_cb) {
+//         hidl_arena arena;
+//         Info info;
+//         info.name.setToArena(mName.c_str(), mName.size(), arena);
+//         _hidl_cb(info);
+//         return Void();
+//     }
+// Copies of arena objects get ordinary heap buffers and may outlive the
+// arena; objects moved from them keep referencing it.
+struct hidl_arena {
+    hidl_arena() = default;
+    ~hidl_arena();
+
+    hidl_arena(const hidl_arena &) = delete;
+    hidl_arena &operator=(const hidl_arena &) = delete;
+
+    // Uninitialized memory that stays valid until reset() or destruction.
+    void *allocate(size_t size, size_t alignment);
+
+    // Release everything allocated so far. One chunk is kept, so that an
+    // arena reused for call after call doesn't go back to the heap each time.
+    void reset();
+
+private:
+    struct Chunk;
+
+    void addChunk(size_t size);
+    void rewind();
+
+    Chunk *mChunks = nullptr;  // most recently allocated first
+    uintptr_t mPos = 0;
+    uintptr_t mEnd = 0;
+};
+
 // hidl_death_recipient is a callback interfaced that can be used with
 // linkToDeath() / unlinkToDeath()
 struct hidl_death_recipient : public virtual RefBase {
@@ -84,6 +131,8 @@ struct hidl_death_recipient : public virtual RefBase {
 //    // copy and its enclosed file descriptors will remain valid here.
 // 3) The move constructor does what you would expect; it only owns the handle if the
 //    original did.
+// 4) After setToShared(handle), copies share the handle instead of cloning it, so no
+//    fds are dup()ed; it is closed and deleted when the last of them goes away.
 struct hidl_handle {
     hidl_handle();
     ~hidl_handle();
@@ -105,6 +154,10 @@ struct hidl_handle {
 
     void setTo(native_handle_t* handle, bool shouldOwn = false);
 
+    // Take ownership of handle, sharing it with copies of this hidl_handle (see 4)
+    // above). The handle must not be modified afterwards.
+    void setToShared(native_handle_t* handle);
+
     const native_handle_t* operator->() const;
 
     // implicit conversion to const native_handle_t*
@@ -117,6 +170,11 @@ private:
 
     details::hidl_pointer<const native_handle_t> mHandle __attribute__ ((aligned(8)));
     bool mOwnsHandle __attribute ((aligned(8)));
+    // Nonzero after setToShared(): the id under which mHandle is reference
+    // counted in this process (in padding, so the layout is unchanged). Handles
+    // read from a Parcel carry the sender's value, so it is only used if the
+    // process-local record for the id holds mHandle itself.
+    uint32_t mShareId;
 };
 
 struct hidl_string {
@@ -131,6 +189,14 @@ struct hidl_string {
     hidl_string(const char *, size_t length);
     // copy from an std::string.
     hidl_string(const std::string &);
+    // Reference a string with static storage duration, such as a string
+    // literal, without copying it; data[size] must be '\0'. Like
+    // setToExternal(), but usable for constant initialization. The _hs
+    // literal below is the easiest way to use this.
+    constexpr hidl_string(const char *data, size_t size, details::static_storage_t)
+        : mBuffer(data, details::kStaticStorage),
+          mSize(static_cast<uint32_t>(size)),
+          mOwnsBuffer(false) {}
 
     // move constructor.
     hidl_string(hidl_string &&) noexcept;
@@ -157,6 +223,9 @@ struct hidl_string {
     // for the lifetime of this hidl_string.
     void setToExternal(const char *data, size_t size);
 
+    // Copy data into arena and reference the copy; see hidl_arena.
+    void setToArena(const char *data, size_t size, hidl_arena &arena);
+
     // offsetof(hidl_string, mBuffer) exposed since mBuffer is private.
     static const size_t kOffsetOfBuffer;
 
@@ -172,29 +241,84 @@ private:
     void moveFrom(hidl_string &&);
 };
 
-#define HIDL_STRING_OPERATOR(OP)                                               \
+namespace details {
+
+// Three-way comparison ordering like strcmp, except that it uses the given
+// sizes and so handles embedded '\0's.
+inline int compareStrings(const char *s1, size_t size1, const char *s2, size_t size2) {
+    size_t common = size1 < size2 ? size1 : size2;
+    int result = common == 0 ? 0 : memcmp(s1, s2, common);
+    if (result != 0) {
+        return result;
+    }
+    return size1 < size2 ? -1 : (size1 > size2 ? 1 : 0);
+}
+
+// Zero iff the strings are equal. Cheaper than compareStrings since a length
+// mismatch avoids looking at the data.
+inline int stringsDiffer(const char *s1, size_t size1, const char *s2, size_t size2) {
+    return size1 != size2 || (size1 != 0 && memcmp(s1, s2, size1) != 0);
+}
+
+// Used by std::hash<hidl_string>.
+size_t hashString(const char *data, size_t size);
+
+}  // namespace details
+
+#if __cplusplus >= 201703L
+#define HIDL_STRING_VIEW_OPERATOR(OP, CMP)                                     \
+    inline bool operator OP(const hidl_string &hs, std::string_view s) {      \
+        return details::CMP(hs.c_str(), hs.size(), s.data(), s.size()) OP 0;  \
+    }                                                                          \
+    inline bool operator OP(std::string_view s, const hidl_string &hs) {      \
+        return details::CMP(s.data(), s.size(), hs.c_str(), hs.size()) OP 0;  \
+    }
+#else
+#define HIDL_STRING_VIEW_OPERATOR(OP, CMP)
+#endif
+
+#define HIDL_STRING_OPERATOR(OP, CMP)                                          \
     inline bool operator OP(const hidl_string &hs1, const hidl_string &hs2) {  \
-        return strcmp(hs1.c_str(), hs2.c_str()) OP 0;                          \
+        return details::CMP(hs1.c_str(), hs1.size(),                           \
+                            hs2.c_str(), hs2.size()) OP 0;                     \
     }                                                                          \
     inline bool operator OP(const hidl_string &hs, const char *s) {            \
-        return strcmp(hs.c_str(), s) OP 0;                                     \
+        return details::CMP(hs.c_str(), hs.size(), s, strlen(s)) OP 0;         \
     }                                                                          \
     inline bool operator OP(const char *s, const hidl_string &hs) {            \
-        return strcmp(hs.c_str(), s) OP 0;                                     \
-    }
+        return details::CMP(s, strlen(s), hs.c_str(), hs.size()) OP 0;         \
+    }                                                                          \
+    inline bool operator OP(const hidl_string &hs, const std::string &s) {     \
+        return details::CMP(hs.c_str(), hs.size(), s.data(), s.size()) OP 0;   \
+    }                                                                          \
+    inline bool operator OP(const std::string &s, const hidl_string &hs) {     \
+        return details::CMP(s.data(), s.size(), hs.c_str(), hs.size()) OP 0;   \
+    }                                                                          \
+    HIDL_STRING_VIEW_OPERATOR(OP, CMP)
 
-HIDL_STRING_OPERATOR(==)
-HIDL_STRING_OPERATOR(!=)
-HIDL_STRING_OPERATOR(<)
-HIDL_STRING_OPERATOR(<=)
-HIDL_STRING_OPERATOR(>)
-HIDL_STRING_OPERATOR(>=)
+HIDL_STRING_OPERATOR(==, stringsDiffer)
+HIDL_STRING_OPERATOR(!=, stringsDiffer)
+HIDL_STRING_OPERATOR(<, compareStrings)
+HIDL_STRING_OPERATOR(<=, compareStrings)
+HIDL_STRING_OPERATOR(>, compareStrings)
+HIDL_STRING_OPERATOR(>=, compareStrings)
 
 #undef HIDL_STRING_OPERATOR
+#undef HIDL_STRING_VIEW_OPERATOR
 
 // Send our content to the output stream
 std::ostream& operator<<(std::ostream& os, const hidl_string& str);
 
+inline namespace literals {
+
+// "default"_hs is a hidl_string referencing the literal, so it doesn't
+// allocate.
+inline hidl_string operator"" _hs(const char *s, size_t size) {
+    return hidl_string(s, size, details::kStaticStorage);
+}
+
+}  // namespace literals
+
 
 // hidl_memory is a structure that can be used to transfer
 // pieces of shared memory between processes. The assumption
@@ -280,13 +404,31 @@ private:
 
 ////////////////////////////////////////////////////////////////////////////////
 
+namespace details {
+
+// Whether arrays of T can be compared with memcmp, i.e. T has no padding and
+// T::operator== is bitwise equality. Only integral, enum and pointer types
+// qualify by default; floating point types are excluded because of -0.0 and
+// NaN. Structs have to opt in by specializing this to std::true_type, which
+// is only correct if they have no padding and their operator== compares
+// every member exactly, as the ones hidl-gen generates do.
+template<typename T>
+struct is_bitwise_comparable
+    : std::integral_constant<bool, std::is_integral<T>::value || std::is_enum<T>::value ||
+                                       std::is_pointer<T>::value> {};
+
+}  // namespace details
+
 template<typename T>
 struct hidl_vec {
     hidl_vec()
         : mBuffer(NULL),
           mSize(0),
-          mOwnsBuffer(true) {
+          mOwnsBuffer(true),
+          mCapacityOrder(0),
+          mBufferKind(kHeapBuffer) {
         static_assert(hidl_vec<T>::kOffsetOfBuffer == 0, "wrong offset");
+        static_assert(sizeof(hidl_vec<T>) == 16, "wrong size");
     }
 
     hidl_vec(const hidl_vec<T> &other) : hidl_vec() {
@@ -294,33 +436,41 @@ struct hidl_vec {
     }
 
     hidl_vec(hidl_vec<T> &&other) noexcept
-    : mOwnsBuffer(false) {
+    : mOwnsBuffer(false),
+      mCapacityOrder(0),
+      mBufferKind(kHeapBuffer) {
         *this = std::move(other);
     }
 
     hidl_vec(const std::initializer_list<T> list)
-            : mOwnsBuffer(true) {
+            : mOwnsBuffer(true),
+              mCapacityOrder(0),
+              mBufferKind(kHeapBuffer) {
         if (list.size() > UINT32_MAX) {
             details::logAlwaysFatal("hidl_vec can't hold more than 2^32 elements.");
         }
         mSize = static_cast<uint32_t>(list.size());
-        mBuffer = new T[mSize];
-
-        size_t idx = 0;
-        for (auto it = list.begin(); it != list.end(); ++it) {
-            mBuffer[idx++] = *it;
-        }
+        mBuffer = allocate(mSize);
+        copyElements(mBuffer, list.begin(), mSize);
     }
 
     hidl_vec(const std::vector<T> &other) : hidl_vec() {
         *this = other;
     }
 
+    // move the elements out of an std::vector.
+    hidl_vec(std::vector<T> &&other) : hidl_vec() {
+        *this = std::move(other);
+    }
+
     template <typename InputIterator,
               typename = typename std::enable_if<std::is_convertible<
                   typename std::iterator_traits<InputIterator>::iterator_category,
                   std::input_iterator_tag>::value>::type>
-    hidl_vec(InputIterator first, InputIterator last) : mOwnsBuffer(true) {
+    hidl_vec(InputIterator first, InputIterator last)
+            : mOwnsBuffer(true),
+              mCapacityOrder(0),
+              mBufferKind(kHeapBuffer) {
         auto size = std::distance(first, last);
         if (size > static_cast<int64_t>(UINT32_MAX)) {
             details::logAlwaysFatal("hidl_vec can't hold more than 2^32 elements.");
@@ -329,34 +479,44 @@ struct hidl_vec {
             details::logAlwaysFatal("size can't be negative.");
         }
         mSize = static_cast<uint32_t>(size);
-        mBuffer = new T[mSize];
-
-        size_t idx = 0;
-        for (; first != last; ++first) {
-            mBuffer[idx++] = static_cast<T>(*first);
-        }
+        mBuffer = allocate(mSize);
+        copyRange(mBuffer, first, last);
     }
 
     ~hidl_vec() {
-        if (mOwnsBuffer) {
-            delete[] mBuffer;
-        }
+        freeBuffer();
         mBuffer = NULL;
     }
 
     // Reference an existing array, optionally taking ownership. It is the
     // caller's responsibility to ensure that the underlying memory stays
-    // valid for the lifetime of this hidl_vec.
+    // valid for the lifetime of this hidl_vec. If shouldOwn is true, data
+    // must have been allocated with new[].
     void setToExternal(T *data, size_t size, bool shouldOwn = false) {
-        if (mOwnsBuffer) {
-            delete [] mBuffer;
-        }
+        freeBuffer();
         mBuffer = data;
         if (size > UINT32_MAX) {
             details::logAlwaysFatal("external vector size exceeds 2^32 elements.");
         }
         mSize = static_cast<uint32_t>(size);
         mOwnsBuffer = shouldOwn;
+        mCapacityOrder = 0;
+        mBufferKind = kArrayBuffer;
+    }
+
+    // Copy size elements from data into arena; see hidl_arena. The elements
+    // are still destroyed by this vector, but their memory isn't freed.
+    void setToArena(const T *data, size_t size, hidl_arena &arena) {
+        if (size > UINT32_MAX) {
+            details::logAlwaysFatal("hidl_vec can't hold more than 2^32 elements.");
+        }
+        freeBuffer();
+        mBuffer = allocateFromArena(size, arena);
+        copyElements(mBuffer, data, size);
+        mSize = static_cast<uint32_t>(size);
+        mOwnsBuffer = true;
+        mCapacityOrder = 0;
+        mBufferKind = kArenaBuffer;
     }
 
     T *data() {
@@ -367,30 +527,45 @@ struct hidl_vec {
         return mBuffer;
     }
 
+    // Give up ownership of the elements. The returned array must be freed
+    // with delete[]; it is nullptr if the vector is empty.
     T *releaseData() {
-        if (!mOwnsBuffer && mSize > 0) {
-            resize(mSize);
+        if (!mOwnsBuffer || mBufferKind != kArrayBuffer) {
+            T *array = nullptr;
+            if (mSize > 0) {
+                array = new T[mSize];
+                for (size_t i = 0; i < mSize; ++i) {
+                    if (mOwnsBuffer) {
+                        array[i] = std::move(mBuffer[i]);
+                    } else {
+                        array[i] = mBuffer[i];
+                    }
+                }
+            }
+            freeBuffer();
+            mBuffer = array;
+            mBufferKind = kArrayBuffer;
         }
         mOwnsBuffer = false;
+        mCapacityOrder = 0;
         return mBuffer;
     }
 
     hidl_vec &operator=(hidl_vec &&other) noexcept {
-        if (mOwnsBuffer) {
-            delete[] mBuffer;
-        }
+        freeBuffer();
         mBuffer = other.mBuffer;
         mSize = other.mSize;
         mOwnsBuffer = other.mOwnsBuffer;
+        mCapacityOrder = other.mCapacityOrder;
+        mBufferKind = other.mBufferKind;
         other.mOwnsBuffer = false;
+        other.mCapacityOrder = 0;
         return *this;
     }
 
     hidl_vec &operator=(const hidl_vec &other) {
         if (this != &other) {
-            if (mOwnsBuffer) {
-                delete[] mBuffer;
-            }
+            freeBuffer();
             copyFrom(other, other.mSize);
         }
 
@@ -399,19 +574,55 @@ struct hidl_vec {
 
     // copy from an std::vector.
     hidl_vec &operator=(const std::vector<T> &other) {
-        if (mOwnsBuffer) {
-            delete[] mBuffer;
-        }
+        freeBuffer();
         copyFrom(other, other.size());
         return *this;
     }
 
+    // move the elements out of an std::vector, leaving it empty.
+    hidl_vec &operator=(std::vector<T> &&other) {
+        if (other.size() > UINT32_MAX) {
+            details::logAlwaysFatal("hidl_vec can't hold more than 2^32 elements.");
+        }
+        freeBuffer();
+        mSize = static_cast<uint32_t>(other.size());
+        mOwnsBuffer = true;
+        mCapacityOrder = 0;
+        mBufferKind = kHeapBuffer;
+        mBuffer = allocate(mSize);
+        moveArray(mBuffer, other, mSize, 0 /* prefer bulk move */);
+        other.clear();
+        return *this;
+    }
+
     // cast to an std::vector.
-    operator std::vector<T>() const {
-        std::vector<T> v(mSize);
-        for (size_t i = 0; i < mSize; ++i) {
-            v[i] = mBuffer[i];
+    operator std::vector<T>() const & {
+        return std::vector<T>(data(), data() + mSize);
+    }
+
+    // cast to an std::vector, moving the elements if they are owned.
+    operator std::vector<T>() && {
+        return releaseToVector();
+    }
+
+    // Move the elements into an std::vector, leaving this vector empty.
+    // Elements of a buffer that isn't owned are copied instead.
+    std::vector<T> releaseToVector() {
+        std::vector<T> v;
+        if (mOwnsBuffer) {
+            v.reserve(mSize);
+            for (size_t i = 0; i < mSize; ++i) {
+                v.push_back(std::move(mBuffer[i]));
+            }
+        } else {
+            v.assign(data(), data() + mSize);
         }
+        freeBuffer();
+        mBuffer = NULL;
+        mSize = 0;
+        mOwnsBuffer = true;
+        mCapacityOrder = 0;
+        mBufferKind = kHeapBuffer;
         return v;
     }
 
@@ -420,12 +631,8 @@ struct hidl_vec {
         if (mSize != other.size()) {
             return false;
         }
-        for (size_t i = 0; i < mSize; ++i) {
-            if (!(mBuffer[i] == other.mBuffer[i])) {
-                return false;
-            }
-        }
-        return true;
+        return equalElements(mBuffer, other.mBuffer, mSize,
+                             details::is_bitwise_comparable<T>());
     }
 
     // inequality check, assuming that T::operator== is defined.
@@ -445,23 +652,97 @@ struct hidl_vec {
         return mBuffer[index];
     }
 
+    // Elements beyond the current size are value-initialized.
     void resize(size_t size) {
         if (size > UINT32_MAX) {
             details::logAlwaysFatal("hidl_vec can't hold more than 2^32 elements.");
         }
-        T *newBuffer = new T[size];
+        if (!mOwnsBuffer || size > capacity() || (size < mSize && !hasSpareCapacity())) {
+            // Shrinking without spare capacity reallocates, since the unused
+            // part of the buffer couldn't be recorded.
+            reallocate(size, 0 /* capacityOrder */);
+        } else if (size < mSize) {
+            destroyElements(data() + size, mSize - size);
+            mSize = static_cast<uint32_t>(size);
+        }
+        for (size_t i = mSize; i < size; ++i) {
+            new (&data()[i]) T();
+        }
+        mSize = static_cast<uint32_t>(size);
+    }
 
-        for (size_t i = 0; i < std::min(static_cast<uint32_t>(size), mSize); ++i) {
-            newBuffer[i] = mBuffer[i];
+    // Like resize(), but always moves the elements to a buffer of exactly
+    // size elements from arena; see hidl_arena.
+    void resize(size_t size, hidl_arena &arena) {
+        if (size > UINT32_MAX) {
+            details::logAlwaysFatal("hidl_vec can't hold more than 2^32 elements.");
+        }
+        size_t keep = std::min(static_cast<size_t>(mSize), size);
+        replaceBuffer(allocateFromArena(size, arena), keep);
+        mSize = static_cast<uint32_t>(keep);
+        mOwnsBuffer = true;
+        mCapacityOrder = 0;
+        mBufferKind = kArenaBuffer;
+        for (size_t i = mSize; i < size; ++i) {
+            new (&data()[i]) T();
         }
+        mSize = static_cast<uint32_t>(size);
+    }
 
-        if (mOwnsBuffer) {
-            delete[] mBuffer;
+    // Number of elements that can be held before the buffer has to be
+    // reallocated. Only vectors that own their buffer can have spare capacity.
+    size_t capacity() const {
+        if (!hasSpareCapacity()) {
+            return mSize;
         }
-        mBuffer = newBuffer;
+        return static_cast<size_t>(1) << (mCapacityOrder - 1);
+    }
 
-        mSize = static_cast<uint32_t>(size);
-        mOwnsBuffer = true;
+    // Ensure that at least size elements can be held without reallocating.
+    // The capacity is rounded up to the next power of two.
+    void reserve(size_t size) {
+        if (size <= capacity()) {
+            return;
+        }
+        if (size > kMaxReserve) {
+            details::logAlwaysFatal("hidl_vec can't reserve more than 2^31 elements.");
+        }
+        uint8_t order = capacityOrderFor(size);
+        reallocate(static_cast<size_t>(1) << (order - 1), order);
+    }
+
+    // Release any spare capacity.
+    void shrink_to_fit() {
+        if (hasSpareCapacity()) {
+            reallocate(mSize, 0 /* capacityOrder */);
+        }
+    }
+
+    void push_back(const T &value) {
+        emplace_back(value);
+    }
+
+    void push_back(T &&value) {
+        emplace_back(std::move(value));
+    }
+
+    // Append an element constructed in place from args, growing the capacity
+    // geometrically when it is exhausted.
+    template <typename... Args>
+    T &emplace_back(Args &&... args) {
+        if (mSize == UINT32_MAX) {
+            details::logAlwaysFatal("hidl_vec can't hold more than 2^32 elements.");
+        }
+        if (mSize < capacity()) {
+            new (&data()[mSize]) T(std::forward<Args>(args)...);
+        } else {
+            // args may refer to one of our own elements, so construct the
+            // new element before the buffer is reallocated.
+            T value(std::forward<Args>(args)...);
+            reserve(static_cast<size_t>(mSize) + 1);
+            new (&data()[mSize]) T(std::move(value));
+        }
+        return mBuffer[mSize++];
     }
 
     // offsetof(hidl_string, mBuffer) exposed since mBuffer is private.
@@ -515,29 +796,278 @@ public:
     const_iterator end() const { return data()+mSize; }
 
 private:
+    static constexpr size_t kMaxReserve = static_cast<size_t>(1) << 31;
+
+    // How an owned mBuffer was allocated.
+    enum BufferKind : uint8_t {
+        // By allocate(); only elements in [0, mSize) are constructed.
+        kHeapBuffer = 0,
+        // By new[], and handed over through setToExternal().
+        kArrayBuffer = 1,
+        // By allocateFromArena(). Like kHeapBuffer, but the memory is
+        // released by the hidl_arena.
+        kArenaBuffer = 2,
+    };
+
     details::hidl_pointer<T> mBuffer;
     uint32_t mSize;
     bool mOwnsBuffer;
+    // 0 if the capacity is mSize, otherwise the capacity is
+    // 2^(mCapacityOrder - 1). This and mBufferKind occupy what would
+    // otherwise be padding, so they don't change the size of hidl_vec or its
+    // wire format; they are meaningless in a hidl_vec read from a Parcel.
+    uint8_t mCapacityOrder;
+    uint8_t mBufferKind;
+
+    bool hasSpareCapacity() const {
+        return mOwnsBuffer && mCapacityOrder != 0;
+    }
+
+    // Smallest capacity order whose capacity is at least size.
+    static uint8_t capacityOrderFor(size_t size) {
+        uint8_t order = 1;
+        while ((static_cast<size_t>(1) << (order - 1)) < size) {
+            ++order;
+        }
+        return order;
+    }
+
+    // Uninitialized storage for capacity elements.
+    static T *allocate(size_t capacity) {
+        if (capacity == 0) {
+            return NULL;
+        }
+        void *buffer = malloc(bufferSize(capacity));
+        if (buffer == NULL) {
+            details::logAlwaysFatal("hidl_vec allocation failed.");
+        }
+        return static_cast<T *>(buffer);
+    }
+
+    static T *allocateFromArena(size_t capacity, hidl_arena &arena) {
+        if (capacity == 0) {
+            return NULL;
+        }
+        return static_cast<T *>(arena.allocate(bufferSize(capacity), alignof(T)));
+    }
+
+    static size_t bufferSize(size_t capacity) {
+        if (capacity > SIZE_MAX / sizeof(T)) {
+            details::logAlwaysFatal("hidl_vec allocation size overflows.");
+        }
+        return capacity * sizeof(T);
+    }
+
+    // Destroy the elements and free the buffer if it is owned.
+    void freeBuffer() {
+        if (!mOwnsBuffer) {
+            return;
+        }
+        if (mBufferKind == kArrayBuffer) {
+            delete[] mBuffer;
+            return;
+        }
+        destroyElements(mBuffer, mSize);
+        if (mBufferKind == kHeapBuffer) {
+            free(static_cast<void *>(mBuffer));
+        }
+    }
+
+    // Move to a new owned buffer holding capacity elements, keeping as many
+    // of the current elements as fit. Elements are moved out of owned
+    // buffers and copied out of external ones. mSize is clamped to capacity.
+    void reallocate(size_t capacity, uint8_t capacityOrder) {
+        size_t keep = std::min(static_cast<size_t>(mSize), capacity);
+
+        if (std::is_trivially_copyable<T>::value && mOwnsBuffer &&
+            mBufferKind == kHeapBuffer && capacity > 0) {
+            void *buffer = realloc(static_cast<void *>(mBuffer), bufferSize(capacity));
+            if (buffer == NULL) {
+                details::logAlwaysFatal("hidl_vec allocation failed.");
+            }
+            mBuffer = static_cast<T *>(buffer);
+        } else {
+            replaceBuffer(allocate(capacity), keep);
+        }
+
+        mSize = static_cast<uint32_t>(keep);
+        mOwnsBuffer = true;
+        mCapacityOrder = capacityOrder;
+        mBufferKind = kHeapBuffer;
+    }
+
+    // Move the first keep elements to newBuffer, or copy them if they aren't
+    // owned, and free the current buffer.
+    void replaceBuffer(T *newBuffer, size_t keep) {
+        if (mOwnsBuffer) {
+            moveElements(newBuffer, mBuffer, keep);
+        } else {
+            copyExternalElements(newBuffer, mBuffer, keep, std::is_copy_constructible<T>());
+        }
+        freeBuffer();
+        mBuffer = newBuffer;
+    }
 
     // copy from an array-like object, assuming my resources are freed.
     template <typename Array>
     void copyFrom(const Array &data, size_t size) {
         mSize = static_cast<uint32_t>(size);
         mOwnsBuffer = true;
-        if (mSize > 0) {
-            mBuffer = new T[size];
-            for (size_t i = 0; i < size; ++i) {
-                mBuffer[i] = data[i];
+        mCapacityOrder = 0;
+        mBufferKind = kHeapBuffer;
+        mBuffer = allocate(size);
+        copyArray(mBuffer, data, size, 0 /* prefer bulk copy */);
+    }
+
+    // Copy-construct count elements from src into uninitialized storage at
+    // dst, as a single memcpy when T is trivially copyable.
+    static void copyElements(T *dst, const T *src, size_t count) {
+        copyElements(dst, src, count, std::is_trivially_copyable<T>());
+    }
+
+    static void copyElements(T *dst, const T *src, size_t count, std::true_type) {
+        if (count > 0) {
+            memcpy(dst, src, count * sizeof(T));
+        }
+    }
+
+    static void copyElements(T *dst, const T *src, size_t count, std::false_type) {
+        for (size_t i = 0; i < count; ++i) {
+            new (&dst[i]) T(src[i]);
+        }
+    }
+
+    static void copyExternalElements(T *dst, const T *src, size_t count, std::true_type) {
+        copyElements(dst, src, count);
+    }
+
+    static void copyExternalElements(T *, const T *, size_t count, std::false_type) {
+        if (count > 0) {
+            details::logAlwaysFatal("hidl_vec can't copy move-only elements it doesn't own.");
+        }
+    }
+
+    // Move-construct count elements from src into uninitialized storage at
+    // dst. The elements at src are left moved-from, not destroyed.
+    static void moveElements(T *dst, T *src, size_t count) {
+        moveElements(dst, src, count, std::is_trivially_copyable<T>());
+    }
+
+    static void moveElements(T *dst, T *src, size_t count, std::true_type) {
+        copyElements(dst, src, count, std::true_type());
+    }
+
+    static void moveElements(T *dst, T *src, size_t count, std::false_type) {
+        for (size_t i = 0; i < count; ++i) {
+            new (&dst[i]) T(std::move_if_noexcept(src[i]));
+        }
+    }
+
+    static void destroyElements(T *elements, size_t count) {
+        if (!std::is_trivially_destructible<T>::value) {
+            for (size_t i = 0; i < count; ++i) {
+                elements[i].~T();
+            }
+        }
+    }
+
+    // Arrays exposing contiguous storage through data() are copied in bulk.
+    template <typename Array>
+    static auto copyArray(T *dst, const Array &src, size_t count, int)
+            -> decltype(copyElements(dst, src.data(), count)) {
+        copyElements(dst, src.data(), count);
+    }
+
+    template <typename Array>
+    static void copyArray(T *dst, const Array &src, size_t count, long) {
+        for (size_t i = 0; i < count; ++i) {
+            new (&dst[i]) T(src[i]);
+        }
+    }
+
+    // Arrays exposing contiguous storage through data() are moved in bulk.
+    template <typename Array>
+    static auto moveArray(T *dst, Array &src, size_t count, int)
+            -> decltype(moveElements(dst, src.data(), count)) {
+        moveElements(dst, src.data(), count);
+    }
+
+    template <typename Array>
+    static void moveArray(T *dst, Array &src, size_t count, long) {
+        for (size_t i = 0; i < count; ++i) {
+            new (&dst[i]) T(std::move(src[i]));
+        }
+    }
+
+    template <typename InputIterator>
+    static void copyRange(T *dst, InputIterator first, InputIterator last) {
+        for (; first != last; ++first) {
+            new (dst++) T(static_cast<T>(*first));
+        }
+    }
+
+    static void copyRange(T *dst, const T *first, const T *last) {
+        copyElements(dst, first, last - first);
+    }
+
+    static void copyRange(T *dst, T *first, T *last) {
+        copyElements(dst, first, last - first);
+    }
+
+    static bool equalElements(const T *a, const T *b, size_t count, std::true_type) {
+#if __cplusplus >= 201703L
+        static_assert(std::has_unique_object_representations<T>::value,
+                      "is_bitwise_comparable specialized for a type with padding");
+#endif
+        return count == 0 || memcmp(a, b, count * sizeof(T)) == 0;
+    }
+
+    static bool equalElements(const T *a, const T *b, size_t count, std::false_type) {
+        for (size_t i = 0; i < count; ++i) {
+            if (!(a[i] == b[i])) {
+                return false;
             }
-        } else {
-            mBuffer = NULL;
         }
+        return true;
     }
 };
 
 template <typename T>
 const size_t hidl_vec<T>::kOffsetOfBuffer = offsetof(hidl_vec<T>, mBuffer);
 
+template <typename T>
+constexpr size_t hidl_vec<T>::kMaxReserve;
+
+// hidl_vec_view lends the storage of an std::vector to a hidl_vec without
+// copying it, e.g. to pass it to a HIDL method:
+//     foo->setData(hidl_vec_view<uint8_t>(data));
+// The std::vector must outlive the view and must not be resized while it is
+// viewed, so views of temporaries don't compile. The view converts to a const
+// hidl_vec, so the elements can't be modified through it.
+template<typename T>
+struct hidl_vec_view {
+    static_assert(!std::is_same<T, bool>::value, "std::vector<bool> can't be viewed.");
+
+    explicit hidl_vec_view(const std::vector<T> &vec) {
+        mVec.setToExternal(const_cast<T *>(vec.data()), vec.size());
+    }
+    hidl_vec_view(std::vector<T> &&) = delete;
+
+    hidl_vec_view(const hidl_vec_view &) = delete;
+    hidl_vec_view &operator=(const hidl_vec_view &) = delete;
+
+    const hidl_vec<T> &get() const {
+        return mVec;
+    }
+
+    operator const hidl_vec<T> &() const {
+        return mVec;
+    }
+
+private:
+    hidl_vec<T> mVec;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 
 namespace details {
@@ -840,73 +1370,246 @@ inline std::string toString(T t) {
     return std::to_string(t);
 }
 
+// appendToString(out, t) appends toString(t) to out. The overloads for
+// numbers and the hidl_* types write straight into out, so dumping nested
+// containers builds no intermediate strings; any other type (e.g. generated
+// structs) goes through its toString().
+template<typename T>
+void appendToString(std::string &out, const T &t);
+void appendToString(std::string &out, const hidl_string &hs);
+template<typename T>
+void appendToString(std::string &out, const hidl_vec<T> &a);
+template<typename T, size_t SIZE1, size_t... SIZES>
+void appendToString(std::string &out, const hidl_array<T, SIZE1, SIZES...> &a);
+
 namespace details {
 
-template<typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value, T>::type>
-inline std::string toHexString(T t, bool prefix = true) {
+template<typename T, size_t SIZE1, size_t... SIZES>
+void appendToString(std::string &out, const_accessor<T, SIZE1, SIZES...> a);
+
+template<typename T>
+constexpr bool isNegative(T t, std::true_type /* is_signed */) { return t < 0; }
+
+template<typename T>
+constexpr bool isNegative(T, std::false_type /* is_signed */) { return false; }
+
+// Same output as std::to_string(t).
+template<typename T>
+void appendNumber(std::string &out, T t, std::true_type /* is_integral */) {
+    using U = typename std::make_unsigned<
+            typename std::conditional<std::is_same<T, bool>::value, unsigned, T>::type>::type;
+    char buf[24];  // 20 digits of a uint64_t, plus a sign
+    char *end = buf + sizeof(buf);
+    char *p = end;
+    bool negative = isNegative(t, std::is_signed<T>());
+    // Computed without overflow for the most negative value too.
+    U magnitude = negative ? static_cast<U>(-(t + 1)) + 1 : static_cast<U>(t);
+    do {
+        *--p = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (negative) {
+        *--p = '-';
+    }
+    out.append(p, end - p);
+}
+
+inline int formatFloat(char *buf, size_t size, double t) {
+    return snprintf(buf, size, "%f", t);
+}
+
+inline int formatFloat(char *buf, size_t size, long double t) {
+    return snprintf(buf, size, "%Lf", t);
+}
+
+template<typename T>
+void appendNumber(std::string &out, T t, std::false_type /* is_integral */) {
+    char buf[64];
+    int length = formatFloat(buf, sizeof(buf), t);
+    if (length < 0) {
+        return;
+    }
+    if (static_cast<size_t>(length) < sizeof(buf)) {
+        out.append(buf, length);
+        return;
+    }
+    // Huge values are rare; print again straight into out.
+    size_t offset = out.size();
+    out.resize(offset + length + 1);
+    formatFloat(&out[offset], length + 1, t);
+    out.resize(offset + length);
+}
+
+template<typename T>
+void appendToStringImpl(std::string &out, const T &t, std::true_type /* is_arithmetic */) {
+    appendNumber(out, t, std::is_integral<T>());
+}
+
+template<typename T>
+void appendToStringImpl(std::string &out, const T &t, std::false_type /* is_arithmetic */) {
+    using android::hardware::toString;
+    out += toString(t);
+}
+
+// Whether appendHexString can format T itself. ostream prints chars as
+// characters and ignores std::hex for bools and floating point numbers, so
+// those keep going through an ostream to produce identical output.
+template<typename T>
+struct is_plain_hex_formattable
+    : std::integral_constant<bool, std::is_integral<T>::value && !std::is_same<T, bool>::value &&
+                                           !std::is_same<T, char>::value> {};
+
+template<typename T>
+void appendHexString(std::string &out, T t, bool prefix, std::true_type /* plain */) {
+    using U = typename std::make_unsigned<T>::type;
+    U value = static_cast<U>(t);
+    char buf[2 * sizeof(U)];
+    char *end = buf + sizeof(buf);
+    char *p = end;
+    do {
+        *--p = "0123456789abcdef"[value & 0xf];
+        value >>= 4;
+    } while (value != 0);
+    // Like std::showbase, which doesn't print a prefix for zero.
+    if (prefix && t != 0) {
+        out += "0x";
+    }
+    out.append(p, end - p);
+}
+
+template<typename T>
+void appendHexString(std::string &out, T t, bool prefix, std::false_type /* plain */) {
     std::ostringstream os;
     if (prefix) { os << std::showbase; }
     os << std::hex << t;
-    return os.str();
+    out += os.str();
+}
+
+template<typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value, T>::type>
+inline void appendHexString(std::string &out, T t, bool prefix = true) {
+    appendHexString(out, t, prefix, is_plain_hex_formattable<T>());
 }
 
 template<>
-inline std::string toHexString(uint8_t t, bool prefix) {
-    return toHexString(static_cast<int32_t>(t), prefix);
+inline void appendHexString(std::string &out, uint8_t t, bool prefix) {
+    appendHexString(out, static_cast<int32_t>(t), prefix);
 }
 
 template<>
-inline std::string toHexString(int8_t t, bool prefix) {
-    return toHexString(static_cast<int32_t>(t), prefix);
+inline void appendHexString(std::string &out, int8_t t, bool prefix) {
+    appendHexString(out, static_cast<int32_t>(t), prefix);
 }
 
-template<typename Array>
-std::string arrayToString(const Array &a, size_t size);
+template<typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value, T>::type>
+inline std::string toHexString(T t, bool prefix = true) {
+    std::string os;
+    appendHexString(os, t, prefix);
+    return os;
+}
 
 template<size_t SIZE1>
-std::string arraySizeToString() {
-    return std::string{"["} + toString(SIZE1) + "]";
+void appendArraySizes(std::string &out) {
+    out += '[';
+    appendNumber(out, SIZE1, std::true_type());
+    out += ']';
 }
 
 template<size_t SIZE1, size_t SIZE2, size_t... SIZES>
+void appendArraySizes(std::string &out) {
+    appendArraySizes<SIZE1>(out);
+    appendArraySizes<SIZE2, SIZES...>(out);
+}
+
+template<typename Array>
+void appendArray(std::string &out, const Array &a, size_t size) {
+    using android::hardware::appendToString;
+    out += '{';
+    for (size_t i = 0; i < size; ++i) {
+        if (i > 0) {
+            out += ", ";
+        }
+        appendToString(out, a[i]);
+    }
+    out += '}';
+}
+
+// Rough output size of n elements of T, used to reserve the output buffer
+// once up front. Only numbers have a useful guess.
+template<typename T>
+size_t estimateToStringSize(size_t n) {
+    return std::is_arithmetic<T>::value ? n * (std::numeric_limits<T>::digits10 + 4) : 0;
+}
+
+template<typename T, size_t SIZE1, size_t... SIZES>
+void appendToString(std::string &out, const_accessor<T, SIZE1, SIZES...> a) {
+    appendArray(out, a, SIZE1);
+}
+
+template<size_t SIZE1>
 std::string arraySizeToString() {
-    return std::string{"["} + toString(SIZE1) + "]" + arraySizeToString<SIZE2, SIZES...>();
+    std::string os;
+    appendArraySizes<SIZE1>(os);
+    return os;
 }
 
-template<typename T, size_t SIZE1>
-std::string toString(details::const_accessor<T, SIZE1> a) {
-    return arrayToString(a, SIZE1);
+template<size_t SIZE1, size_t SIZE2, size_t... SIZES>
+std::string arraySizeToString() {
+    std::string os;
+    appendArraySizes<SIZE1, SIZE2, SIZES...>(os);
+    return os;
 }
 
 template<typename Array>
 std::string arrayToString(const Array &a, size_t size) {
-    using android::hardware::toString;
     std::string os;
-    os += "{";
-    for (size_t i = 0; i < size; ++i) {
-        if (i > 0) {
-            os += ", ";
-        }
-        os += toString(a[i]);
-    }
-    os += "}";
+    appendArray(os, a, size);
     return os;
 }
 
-template<typename T, size_t SIZE1, size_t SIZE2, size_t... SIZES>
-std::string toString(details::const_accessor<T, SIZE1, SIZE2, SIZES...> a) {
-    return arrayToString(a, SIZE1);
+template<typename T, size_t SIZE1, size_t... SIZES>
+std::string toString(details::const_accessor<T, SIZE1, SIZES...> a) {
+    std::string os;
+    appendToString(os, a);
+    return os;
 }
 
 }  //namespace details
 
+template<typename T>
+void appendToString(std::string &out, const T &t) {
+    details::appendToStringImpl(out, t, std::is_arithmetic<T>());
+}
+
+// There will be quotes around the string!
+inline void appendToString(std::string &out, const hidl_string &hs) {
+    out += '"';
+    out += hs.c_str();
+    out += '"';
+}
+
+template<typename T>
+void appendToString(std::string &out, const hidl_vec<T> &a) {
+    out += '[';
+    details::appendNumber(out, a.size(), std::true_type());
+    out += ']';
+    details::appendArray(out, a, a.size());
+}
+
+template<typename T, size_t SIZE1, size_t... SIZES>
+void appendToString(std::string &out, const hidl_array<T, SIZE1, SIZES...> &a) {
+    details::appendArraySizes<SIZE1, SIZES...>(out);
+    details::appendToString(out, details::const_accessor<T, SIZE1, SIZES...>(a.data()));
+}
+
 inline std::string toString(const void *t) {
     return details::toHexString(reinterpret_cast<uintptr_t>(t));
 }
 
 // debug string dump. There will be quotes around the string!
 inline std::string toString(const hidl_string &hs) {
-    return std::string{"\""} + hs.c_str() + "\"";
+    std::string os;
+    appendToString(os, hs);
+    return os;
 }
 
 // debug string dump
@@ -928,25 +1631,34 @@ inline std::string toString(const sp<hidl_death_recipient> &dr) {
 template<typename T>
 std::string toString(const hidl_vec<T> &a) {
     std::string os;
-    os += "[" + toString(a.size()) + "]";
-    os += details::arrayToString(a, a.size());
+    os.reserve(details::estimateToStringSize<T>(a.size()));
+    appendToString(os, a);
     return os;
 }
 
-template<typename T, size_t SIZE1>
-std::string toString(const hidl_array<T, SIZE1> &a) {
-    return details::arraySizeToString<SIZE1>()
-            + details::toString(details::const_accessor<T, SIZE1>(a.data()));
-}
-
-template<typename T, size_t SIZE1, size_t SIZE2, size_t... SIZES>
-std::string toString(const hidl_array<T, SIZE1, SIZE2, SIZES...> &a) {
-    return details::arraySizeToString<SIZE1, SIZE2, SIZES...>()
-            + details::toString(details::const_accessor<T, SIZE1, SIZE2, SIZES...>(a.data()));
+template<typename T, size_t SIZE1, size_t... SIZES>
+std::string toString(const hidl_array<T, SIZE1, SIZES...> &a) {
+    std::string os;
+    os.reserve(details::estimateToStringSize<T>(
+            hidl_array<T, SIZE1, SIZES...>::elementCount()));
+    appendToString(os, a);
+    return os;
 }
 
 }  // namespace hardware
 }  // namespace android
 
+namespace std {
+
+// Allows hidl_string keys in unordered containers without converting them to
+// std::string first.
+template <>
+struct hash<android::hardware::hidl_string> {
+    size_t operator()(const android::hardware::hidl_string &s) const {
+        return android::hardware::details::hashString(s.c_str(), s.size());
+    }
+};
+
+}  // namespace std
 
 #endif  // ANDROID_HIDL_SUPPORT_H
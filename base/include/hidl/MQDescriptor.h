@@ -42,6 +42,15 @@ static_assert(offsetof(GrantorDescriptor, extent) == 16, "wrong offset");
 static_assert(sizeof(GrantorDescriptor) == 24, "wrong size");
 static_assert(__alignof(GrantorDescriptor) == 8, "wrong alignment");
 
+enum GrantorFlags : uint32_t {
+  /*
+   * The grantor's memory is to be mapped twice, back to back, so that a
+   * range wrapping around the end of a ring buffer is contiguous in the
+   * second mapping. Its offset and extent are multiples of the page size.
+   */
+  kGrantorMirrored = 0x01
+};
+
 enum MQFlavor : uint32_t {
   /*
    * kSynchronizedReadWrite represents the wait-free synchronized flavor of the
@@ -54,7 +63,94 @@ enum MQFlavor : uint32_t {
    * succeed. This flavor allows one writer and many readers. A read operation
    * can detect an overwrite and reset the read counter.
    */
-  kUnsynchronizedWrite = 0x02
+  kUnsynchronizedWrite = 0x02,
+  /*
+   * kSynchronizedMultiRead represents the flavor of FMQ with one writer and a
+   * fixed number of readers, each with its own read counter. The writer is
+   * bounded by the slowest reader, so no reader ever loses data.
+   */
+  kSynchronizedMultiRead = 0x04,
+  /*
+   * kSynchronizedVariableLength represents the synchronized flavor of FMQ
+   * carrying variable-size records, each an MQRecordHeader followed by its
+   * payload. The quantum is the records' alignment rather than their size.
+   */
+  kSynchronizedVariableLength = 0x08
+};
+
+/*
+ * Precedes every record in a kSynchronizedVariableLength queue. Records start
+ * at multiples of the quantum; the next one starts at the first multiple after
+ * this one's payload.
+ */
+struct MQRecordHeader {
+    /*
+     * Number of payload bytes following the header.
+     */
+    uint32_t length;
+    uint32_t flags;
+};
+
+static_assert(sizeof(MQRecordHeader) == 8, "wrong size");
+
+enum MQRecordFlags : uint32_t {
+  /*
+   * The record carries no payload and only pads the rest of the buffer, for
+   * writers whose next record doesn't fit before the ring buffer wraps.
+   */
+  kMQRecordSkip = 0x01
+};
+
+/*
+ * Describes how the MQDescriptor(bufferSize, nHandle, messageSize, layout)
+ * constructor places the grantors in the shared memory region. Only the
+ * resulting grantor offsets are sent, so any layout works with any reader.
+ */
+struct MQLayout {
+    /*
+     * Size of a cache line on the devices we run on.
+     */
+    static constexpr size_t kCacheLineSize = 64;
+
+    /*
+     * Whether to allocate a grantor for an EventFlag word, needed for
+     * blocking FMQ operations.
+     */
+    bool configureEventFlag = false;
+
+    /*
+     * Alignment of every grantor's offset: a power of two, at least 8. With
+     * the default, the read counter, write counter, data and EventFlag word
+     * are packed together and the reader and writer false-share a cache line.
+     * kCacheLineSize puts each of them on its own cache line instead.
+     */
+    size_t grantorAlignment = 8;
+
+    /*
+     * Number of readers, each getting a read counter. Only kSynchronizedMultiRead
+     * queues may have more than one.
+     */
+    size_t readerCount = 1;
+
+    /*
+     * Whether the data grantor is flagged kGrantorMirrored. Its offset is then
+     * page aligned and the buffer size is rounded up to whole pages.
+     */
+    bool mirrorData = false;
+
+    /*
+     * Whether the data buffer gets its own fd. The data grantor then uses
+     * fdIndex 1 at offset 0 and everything else stays on fd 0, so the data
+     * can be backed by huge pages or a memfd without the small counters
+     * taking up a huge page. nHandle must have two fds.
+     */
+    bool separateDataFd = false;
+
+    /*
+     * If non-zero, a power of two that the data grantor's offset and the
+     * buffer size are rounded up to, e.g. 2 MB for huge pages.
+     */
+    size_t dataAlignment = 0;
 };
 
 template <typename T, MQFlavor flavor>
@@ -66,19 +162,49 @@ struct MQDescriptor {
     MQDescriptor(size_t bufferSize, native_handle_t* nHandle,
                  size_t messageSize, bool configureEventFlag = false);
 
+    MQDescriptor(size_t bufferSize, native_handle_t* nHandle,
+                 size_t messageSize, const MQLayout& layout);
+
     MQDescriptor();
     ~MQDescriptor();
 
     explicit MQDescriptor(const MQDescriptor &other);
     MQDescriptor &operator=(const MQDescriptor &other) = delete;
 
+    /*
+     * Moves take over the grantors and the handle, so unlike copies they
+     * don't dup() the fds.
+     */
+    MQDescriptor(MQDescriptor &&other) noexcept;
+    MQDescriptor &operator=(MQDescriptor &&other) noexcept;
+
     size_t getSize() const;
 
     size_t getQuantum() const;
 
+    /*
+     * Number of readers with their own read counter; always 1 unless flavor is
+     * kSynchronizedMultiRead.
+     */
+    size_t getReaderCount() const;
+
+    /*
+     * Space taken in the data buffer by a kSynchronizedVariableLength record
+     * with the given payload size, including its header and padding.
+     */
+    size_t getRecordSize(size_t payloadSize) const;
+
+    /*
+     * Number of bytes the grantors need on the given fd of the handle.
+     */
+    size_t getMemorySize(uint32_t fdIndex) const;
+
     int32_t getFlags() const;
 
     bool isHandleValid() const { return mHandle != nullptr; }
+    bool isDataMirrored() const {
+        return mGrantors.size() > DATAPTRPOS && (mGrantors[DATAPTRPOS].flags & kGrantorMirrored);
+    }
     size_t countGrantors() const { return mGrantors.size(); }
 
     inline const ::android::hardware::hidl_vec<GrantorDescriptor> &grantors() const {
@@ -114,6 +240,15 @@ struct MQDescriptor {
      */
     static constexpr int32_t kMinGrantorCountForEvFlagSupport = EVFLAGWORDPOS + 1;
 
+    /*
+     * Index of the read counter GrantorDescriptor of the given reader. Reader
+     * 0 uses READPTRPOS; kSynchronizedMultiRead queues with more readers always
+     * have an EventFlag word and put the other readers' counters after it.
+     */
+    static constexpr size_t readPtrGrantorIndex(size_t reader) {
+        return reader == 0 ? READPTRPOS : EVFLAGWORDPOS + reader;
+    }
+
     //TODO(b/34160777) Identify a better solution that supports remoting.
     static inline size_t alignToWordBoundary(size_t length) {
         constexpr size_t kAlignmentSize = 64;
@@ -136,10 +271,22 @@ struct MQDescriptor {
         return (offset & (kAlignmentSize/8 - 1)) == 0;
     }
 private:
+    static MQLayout layoutFor(bool configureEventFlag) {
+        MQLayout layout;
+        layout.configureEventFlag = configureEventFlag;
+        return layout;
+    }
+
+    static size_t alignTo(size_t length, size_t alignment);
+
+    static void checkQuantum(size_t quantum);
+
     ::android::hardware::hidl_vec<GrantorDescriptor> mGrantors;
     ::android::hardware::details::hidl_pointer<native_handle_t> mHandle;
     uint32_t mQuantum;
     uint32_t mFlags;
+
+    void freeHandle();
 };
 
 template<typename T, MQFlavor flavor>
@@ -162,6 +309,20 @@ using MQDescriptorSync = MQDescriptor<T, kSynchronizedReadWrite>;
 template<typename T>
 using MQDescriptorUnsync = MQDescriptor<T, kUnsynchronizedWrite>;
 
+/*
+ * MQDescriptorMultiRead will describe the synchronized multi-reader
+ * flavor of FMQ.
+ */
+template<typename T>
+using MQDescriptorMultiRead = MQDescriptor<T, kSynchronizedMultiRead>;
+
+/*
+ * MQDescriptorVariableLength will describe the synchronized
+ * variable-length record flavor of FMQ.
+ */
+template<typename T>
+using MQDescriptorVariableLength = MQDescriptor<T, kSynchronizedVariableLength>;
+
 template<typename T, MQFlavor flavor>
 MQDescriptor<T, flavor>::MQDescriptor(
         const std::vector<GrantorDescriptor>& grantors,
@@ -170,6 +331,7 @@ MQDescriptor<T, flavor>::MQDescriptor(
     : mHandle(nhandle),
       mQuantum(size),
       mFlags(flavor) {
+    checkQuantum(size);
     mGrantors.resize(grantors.size());
     for (size_t i = 0; i < grantors.size(); ++i) {
         if (isAlignedToWordBoundary(grantors[i].offset) == false) {
@@ -182,37 +344,110 @@ MQDescriptor<T, flavor>::MQDescriptor(
 template<typename T, MQFlavor flavor>
 MQDescriptor<T, flavor>::MQDescriptor(size_t bufferSize, native_handle_t *nHandle,
                                    size_t messageSize, bool configureEventFlag)
+    : MQDescriptor(bufferSize, nHandle, messageSize, layoutFor(configureEventFlag)) {}
+
+template<typename T, MQFlavor flavor>
+MQDescriptor<T, flavor>::MQDescriptor(size_t bufferSize, native_handle_t *nHandle,
+                                   size_t messageSize, const MQLayout& layout)
     : mHandle(nHandle), mQuantum(messageSize), mFlags(flavor) {
+    checkQuantum(messageSize);
+
+    if (layout.grantorAlignment < 8 ||
+        (layout.grantorAlignment & (layout.grantorAlignment - 1)) != 0) {
+        details::logAlwaysFatal("Grantor alignment must be a power of two of at least 8");
+    }
+
+    if (layout.readerCount == 0 ||
+        (layout.readerCount > 1 && flavor != kSynchronizedMultiRead)) {
+        details::logAlwaysFatal("Invalid reader count for this queue flavor");
+    }
+
+    if ((layout.dataAlignment & (layout.dataAlignment - 1)) != 0) {
+        details::logAlwaysFatal("Data alignment must be a power of two");
+    }
+
+    if (layout.separateDataFd && nHandle != nullptr && nHandle->numFds < 2) {
+        details::logAlwaysFatal("Separate data fd requested but handle has fewer than 2 fds");
+    }
+
     /*
      * If configureEventFlag is true, allocate an additional spot in mGrantor
      * for containing the fd and offset for mmapping the EventFlag word.
+     * Additional readers' read counters go after that.
      */
-    mGrantors.resize(configureEventFlag? kMinGrantorCountForEvFlagSupport : kMinGrantorCount);
+    if (layout.readerCount > 1) {
+        mGrantors.resize(readPtrGrantorIndex(layout.readerCount - 1) + 1);
+    } else {
+        mGrantors.resize(layout.configureEventFlag ? kMinGrantorCountForEvFlagSupport
+                                                   : kMinGrantorCount);
+    }
 
-    size_t memSize[] = {
-        sizeof(RingBufferPosition),  /* memory to be allocated for read pointer counter */
-        sizeof(RingBufferPosition),  /* memory to be allocated for write pointer counter */
-        bufferSize,                  /* memory to be allocated for data buffer */
-        sizeof(std::atomic<uint32_t>)/* memory to be allocated for EventFlag word */
+    /*
+     * The data buffer's offset is aligned to dataAlignment, the page size if
+     * mirrored and the record alignment of variable-length queues; its size
+     * only to those.
+     */
+    size_t dataSizeAlignment = std::max<size_t>(
+            layout.dataAlignment, layout.mirrorData ? sysconf(_SC_PAGESIZE) : 1);
+    if (flavor == kSynchronizedVariableLength) {
+        dataSizeAlignment = std::max(dataSizeAlignment, messageSize);
+    }
+    size_t dataOffsetAlignment = std::max(dataSizeAlignment, layout.grantorAlignment);
+    bufferSize = alignTo(bufferSize, dataSizeAlignment);
+
+    auto memSize = [bufferSize](size_t grantorPos) -> size_t {
+        switch (grantorPos) {
+            case WRITEPTRPOS: return sizeof(RingBufferPosition);
+            case DATAPTRPOS: return bufferSize;
+            case EVFLAGWORDPOS: return sizeof(std::atomic<uint32_t>);
+            default: return sizeof(RingBufferPosition);  /* a read pointer counter */
+        }
     };
 
     /*
      * Create a default grantor descriptor for read, write pointers and
-     * the data buffer. fdIndex parameter is set to 0 by default and
-     * the offset for each grantor is contiguous.
+     * the data buffer. fdIndex parameter is set to 0 unless the data
+     * gets its own fd, and each grantor starts at the next multiple of
+     * grantorAlignment after the previous grantor on the same fd.
      */
-    for (size_t grantorPos = 0, offset = 0;
-         grantorPos < mGrantors.size();
-         offset += memSize[grantorPos++]) {
+    size_t fdOffsets[2] = {0, 0};
+    for (size_t grantorPos = 0; grantorPos < mGrantors.size(); ++grantorPos) {
+        bool isData = grantorPos == DATAPTRPOS;
+        uint32_t fdIndex = isData && layout.separateDataFd ? 1 : 0;
+        size_t offset = alignTo(fdOffsets[fdIndex],
+                                isData ? dataOffsetAlignment : layout.grantorAlignment);
+        if (offset > UINT32_MAX) {
+            details::logAlwaysFatal("Queue size too large");
+        }
         mGrantors[grantorPos] = {
-            0 /* grantor flags */,
-            0 /* fdIndex */,
-            static_cast<uint32_t>(alignToWordBoundary(offset)),
-            memSize[grantorPos]
+            isData && layout.mirrorData ? kGrantorMirrored : 0u /* grantor flags */,
+            fdIndex,
+            static_cast<uint32_t>(offset),
+            memSize(grantorPos)
         };
+        fdOffsets[fdIndex] = offset + memSize(grantorPos);
+    }
+}
+
+template<typename T, MQFlavor flavor>
+void MQDescriptor<T, flavor>::checkQuantum(size_t quantum) {
+    /*
+     * The default constructor leaves the quantum 0 for every flavor.
+     */
+    if (flavor == kSynchronizedVariableLength && quantum != 0 &&
+        (quantum < alignof(MQRecordHeader) || (quantum & (quantum - 1)) != 0)) {
+        details::logAlwaysFatal("Record alignment must be a power of two of at least 4");
     }
 }
 
+template<typename T, MQFlavor flavor>
+size_t MQDescriptor<T, flavor>::alignTo(size_t length, size_t alignment) {
+    if (length > SIZE_MAX - alignment + 1) {
+        details::logAlwaysFatal("Queue size too large");
+    }
+    return (length + alignment - 1) & ~(alignment - 1);
+}
+
 template<typename T, MQFlavor flavor>
 MQDescriptor<T, flavor>::MQDescriptor(const MQDescriptor<T, flavor> &other)
     : mGrantors(other.mGrantors),
@@ -233,6 +468,32 @@ MQDescriptor<T, flavor>::MQDescriptor(const MQDescriptor<T, flavor> &other)
     }
 }
 
+template<typename T, MQFlavor flavor>
+MQDescriptor<T, flavor>::MQDescriptor(MQDescriptor<T, flavor> &&other) noexcept
+    : mGrantors(std::move(other.mGrantors)),
+      mHandle(other.mHandle),
+      mQuantum(other.mQuantum),
+      mFlags(other.mFlags) {
+    // A moved-from hidl_vec still points at the buffer it gave away.
+    other.mGrantors = ::android::hardware::hidl_vec<GrantorDescriptor>();
+    other.mHandle = nullptr;
+}
+
+template<typename T, MQFlavor flavor>
+MQDescriptor<T, flavor> &MQDescriptor<T, flavor>::operator=(
+        MQDescriptor<T, flavor> &&other) noexcept {
+    if (this != &other) {
+        freeHandle();
+        mGrantors = std::move(other.mGrantors);
+        mHandle = other.mHandle;
+        mQuantum = other.mQuantum;
+        mFlags = other.mFlags;
+        other.mGrantors = ::android::hardware::hidl_vec<GrantorDescriptor>();
+        other.mHandle = nullptr;
+    }
+    return *this;
+}
+
 template<typename T, MQFlavor flavor>
 MQDescriptor<T, flavor>::MQDescriptor() : MQDescriptor(
         std::vector<android::hardware::GrantorDescriptor>(),
@@ -241,9 +502,15 @@ MQDescriptor<T, flavor>::MQDescriptor() : MQDescriptor(
 
 template<typename T, MQFlavor flavor>
 MQDescriptor<T, flavor>::~MQDescriptor() {
+    freeHandle();
+}
+
+template<typename T, MQFlavor flavor>
+void MQDescriptor<T, flavor>::freeHandle() {
     if (mHandle != nullptr) {
         native_handle_close(mHandle);
         native_handle_delete(mHandle);
+        mHandle = nullptr;
     }
 }
 
@@ -258,6 +525,37 @@ size_t MQDescriptor<T, flavor>::getQuantum() const { return mQuantum; }
 template<typename T, MQFlavor flavor>
 int32_t MQDescriptor<T, flavor>::getFlags() const { return mFlags; }
 
+template<typename T, MQFlavor flavor>
+size_t MQDescriptor<T, flavor>::getMemorySize(uint32_t fdIndex) const {
+    size_t size = 0;
+    for (const GrantorDescriptor &grantor : mGrantors) {
+        if (grantor.fdIndex == fdIndex) {
+            size = std::max<size_t>(size, grantor.offset + grantor.extent);
+        }
+    }
+    return size;
+}
+
+template<typename T, MQFlavor flavor>
+size_t MQDescriptor<T, flavor>::getRecordSize(size_t payloadSize) const {
+    if (flavor != kSynchronizedVariableLength) {
+        details::logAlwaysFatal("Only variable-length queues hold records");
+    }
+    if (payloadSize > SIZE_MAX - sizeof(MQRecordHeader)) {
+        details::logAlwaysFatal("Record too large");
+    }
+    size_t size = sizeof(MQRecordHeader) + payloadSize;
+    return mQuantum == 0 ? size : alignTo(size, mQuantum);
+}
+
+template<typename T, MQFlavor flavor>
+size_t MQDescriptor<T, flavor>::getReaderCount() const {
+    if (flavor != kSynchronizedMultiRead || mGrantors.size() <= kMinGrantorCountForEvFlagSupport) {
+        return 1;
+    }
+    return mGrantors.size() - kMinGrantorCountForEvFlagSupport + 1;
+}
+
 template<typename T, MQFlavor flavor>
 std::string toString(const MQDescriptor<T, flavor> &q) {
     std::string os;
@@ -267,10 +565,22 @@ std::string toString(const MQDescriptor<T, flavor> &q) {
     if (flavor & kUnsynchronizedWrite) {
         os += "fmq_unsync";
     }
+    if (flavor & kSynchronizedMultiRead) {
+        os += "fmq_multiread";
+    }
+    if (flavor & kSynchronizedVariableLength) {
+        os += "fmq_varlen";
+    }
     os += " {"
-       + toString(q.grantors().size()) + " grantor(s), "
-       + "size = " + toString(q.getSize())
-       + ", .handle = " + toString(q.handle())
+       + toString(q.grantors().size()) + " grantor(s), ";
+    if (flavor & kSynchronizedMultiRead) {
+        os += toString(q.getReaderCount()) + " reader(s), ";
+    }
+    os += "size = " + toString(q.getSize());
+    if (q.isDataMirrored()) {
+        os += " (mirrored)";
+    }
+    os += ", .handle = " + toString(q.handle())
        + ", .quantum = " + toString(q.getQuantum()) + "}";
     return os;
 }
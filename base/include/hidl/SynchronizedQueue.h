@@ -17,10 +17,21 @@
 #ifndef ANDROID_HIDL_SYNCHRONIZED_QUEUE_H
 #define ANDROID_HIDL_SYNCHRONIZED_QUEUE_H
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <queue>
 #include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 namespace android {
 namespace hardware {
@@ -37,15 +48,37 @@ struct SynchronizedQueue {
      */
     T wait_pop();
 
+    /* Moves up to max items from the front of the queue to the end of out,
+     * all under one lock.
+     *
+     * Blocks until at least one item is available. Returns the number moved.
+     */
+    size_t drain(std::vector<T> *out, size_t max);
+
+    /* Like drain(out, max), but gives up and returns 0 if no item becomes
+     * available within timeout.
+     */
+    size_t drain_for(std::vector<T> *out, size_t max, std::chrono::nanoseconds timeout);
+
     /* Puts an item onto the end of the queue.
      */
     bool push(const T& item);
+    bool push(T&& item);
+
+    /* Puts the items of [first, last) onto the end of the queue under one
+     * lock, waking the consumer once. Returns the number of items added,
+     * which is smaller than the range if the limit is reached.
+     */
+    template <typename Iterator>
+    size_t push_all(Iterator first, Iterator last);
 
     /* Gets the size of the array.
      */
     size_t size();
 
 private:
+    size_t takeLocked(std::vector<T> *out, size_t max);
+
     std::condition_variable mCondition;
     std::mutex mMutex;
     std::queue<T> mQueue;
@@ -64,29 +97,88 @@ T SynchronizedQueue<T>::wait_pop() {
         return !this->mQueue.empty();
     });
 
-    T item = mQueue.front();
+    T item = std::move(mQueue.front());
     mQueue.pop();
 
     return item;
 }
 
+template <typename T>
+size_t SynchronizedQueue<T>::drain(std::vector<T> *out, size_t max) {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    mCondition.wait(lock, [this]{
+        return !this->mQueue.empty();
+    });
+
+    return takeLocked(out, max);
+}
+
+template <typename T>
+size_t SynchronizedQueue<T>::drain_for(std::vector<T> *out, size_t max,
+                                       std::chrono::nanoseconds timeout) {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if (!mCondition.wait_for(lock, timeout, [this]{
+            return !this->mQueue.empty();
+        })) {
+        return 0;
+    }
+
+    return takeLocked(out, max);
+}
+
+template <typename T>
+size_t SynchronizedQueue<T>::takeLocked(std::vector<T> *out, size_t max) {
+    size_t count = 0;
+    for (; count < max && !mQueue.empty(); ++count) {
+        out->push_back(std::move(mQueue.front()));
+        mQueue.pop();
+    }
+    return count;
+}
+
 template <typename T>
 bool SynchronizedQueue<T>::push(const T &item) {
+    return push(T(item));
+}
+
+template <typename T>
+bool SynchronizedQueue<T>::push(T &&item) {
     bool success;
     {
         std::unique_lock<std::mutex> lock(mMutex);
         if (mQueue.size() < mQueueLimit) {
-            mQueue.push(item);
+            mQueue.push(std::move(item));
             success = true;
         } else {
             success = false;
         }
     }
 
-    mCondition.notify_one();
+    if (success) {
+        mCondition.notify_one();
+    }
     return success;
 }
 
+template <typename T>
+template <typename Iterator>
+size_t SynchronizedQueue<T>::push_all(Iterator first, Iterator last) {
+    size_t count = 0;
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        for (; first != last && mQueue.size() < mQueueLimit; ++first, ++count) {
+            mQueue.push(*first);
+        }
+    }
+
+    if (count > 0) {
+        mCondition.notify_one();
+    }
+    return count;
+}
+
 template <typename T>
 size_t SynchronizedQueue<T>::size() {
     std::unique_lock<std::mutex> lock(mMutex);
@@ -94,6 +186,277 @@ size_t SynchronizedQueue<T>::size() {
     return mQueue.size();
 }
 
+/* Lock-free alternative to SynchronizedQueue for many producers and a single
+ * consumer: a ring buffer of limit slots. push() never takes a lock, so a
+ * producer can't be blocked by a lower priority thread holding one; the
+ * consumer spins briefly, then sleeps on a futex that producers only wake
+ * when it is actually sleeping.
+ */
+template <typename T>
+struct BoundedMpscQueue {
+    BoundedMpscQueue(size_t limit);
+    ~BoundedMpscQueue();
+
+    /* Gets an item from the front of the queue.
+     *
+     * Blocks until the item is available. Only one thread may call this.
+     */
+    T wait_pop();
+
+    /* Moves up to max items from the front of the queue to the end of out.
+     *
+     * Blocks until at least one item is available. Returns the number moved.
+     */
+    size_t drain(std::vector<T> *out, size_t max);
+
+    /* Like drain(out, max), but gives up and returns 0 if no item becomes
+     * available within timeout.
+     */
+    size_t drain_for(std::vector<T> *out, size_t max, std::chrono::nanoseconds timeout);
+
+    /* Puts an item onto the end of the queue. Fails if it is full.
+     */
+    bool push(const T& item);
+    bool push(T&& item);
+
+    /* Puts the items of [first, last) onto the end of the queue, waking the
+     * consumer at most once. Returns the number of items added, which is
+     * smaller than the range if the queue fills up.
+     */
+    template <typename Iterator>
+    size_t push_all(Iterator first, Iterator last);
+
+    /* Gets the size of the array.
+     */
+    size_t size();
+
+private:
+    static constexpr int kSpinCount = 100;
+    static constexpr size_t kCacheLineSize = 64;
+
+    /* A slot holds an item once its sequence is one past the slot's position
+     * and is free for position p once its sequence is p.
+     */
+    struct Cell {
+        std::atomic<uint64_t> sequence;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    T *itemAt(Cell &cell) {
+        return reinterpret_cast<T *>(&cell.storage);
+    }
+
+    Cell &cellAt(uint64_t pos) {
+        return mCells[mQueueLimit > 0 ? pos % mQueueLimit : 0];
+    }
+
+    bool isReady(uint64_t pos) {
+        return cellAt(pos).sequence.load(std::memory_order_acquire) == pos + 1;
+    }
+
+    using Clock = std::chrono::steady_clock;
+
+    // Waits until the item at pos, the head, has been pushed, or until
+    // deadline unless it is null. Returns whether the item is there.
+    bool waitForItem(uint64_t pos, const Clock::time_point *deadline);
+    size_t takeReady(uint64_t pos, std::vector<T> *out, size_t max);
+    // Removes the item at pos, the head, once it is ready.
+    T takeItem(uint64_t pos);
+    // Adds an item without waking the consumer.
+    template <typename U>
+    bool enqueue(U &&item);
+    void wakeConsumer();
+
+    static void futexWait(std::atomic<int32_t> *word, int32_t value,
+                          const struct timespec *timeout = nullptr) {
+        syscall(SYS_futex, reinterpret_cast<int32_t *>(word), FUTEX_WAIT_PRIVATE, value,
+                timeout, nullptr, 0);
+    }
+
+    static void futexWake(std::atomic<int32_t> *word) {
+        syscall(SYS_futex, reinterpret_cast<int32_t *>(word), FUTEX_WAKE_PRIVATE, 1,
+                nullptr, nullptr, 0);
+    }
+
+    const size_t mQueueLimit;
+    std::unique_ptr<Cell[]> mCells;
+
+    // Written by producers, the consumer and both, respectively; kept on
+    // separate cache lines.
+    char mPad0[kCacheLineSize];
+    std::atomic<uint64_t> mTail;
+    char mPad1[kCacheLineSize];
+    std::atomic<uint64_t> mHead;
+    char mPad2[kCacheLineSize];
+    std::atomic<int32_t> mConsumerWaiting;
+    char mPad3[kCacheLineSize];
+};
+
+static_assert(sizeof(std::atomic<int32_t>) == sizeof(int32_t), "futex word size");
+
+template <typename T>
+BoundedMpscQueue<T>::BoundedMpscQueue(size_t limit)
+    : mQueueLimit(limit),
+      mCells(new Cell[limit > 0 ? limit : 1]),
+      mTail(0),
+      mHead(0),
+      mConsumerWaiting(0) {
+    for (size_t i = 0; i < (mQueueLimit > 0 ? mQueueLimit : 1); ++i) {
+        mCells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+template <typename T>
+BoundedMpscQueue<T>::~BoundedMpscQueue() {
+    for (uint64_t pos = mHead.load(); pos < mTail.load(); ++pos) {
+        itemAt(mCells[pos % mQueueLimit])->~T();
+    }
+}
+
+template <typename T>
+bool BoundedMpscQueue<T>::waitForItem(uint64_t pos, const Clock::time_point *deadline) {
+    for (int spins = 0; !isReady(pos);) {
+        if (++spins < kSpinCount) {
+            std::this_thread::yield();
+            continue;
+        }
+        struct timespec timeout;
+        if (deadline != nullptr) {
+            auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    *deadline - Clock::now());
+            if (left.count() <= 0) {
+                return false;
+            }
+            timeout.tv_sec = left.count() / 1000000000;
+            timeout.tv_nsec = left.count() % 1000000000;
+        }
+        mConsumerWaiting.store(1);
+        if (cellAt(pos).sequence.load() != pos + 1) {
+            futexWait(&mConsumerWaiting, 1, deadline != nullptr ? &timeout : nullptr);
+        }
+        mConsumerWaiting.store(0, std::memory_order_relaxed);
+        spins = 0;
+    }
+    return true;
+}
+
+template <typename T>
+T BoundedMpscQueue<T>::takeItem(uint64_t pos) {
+    Cell &cell = cellAt(pos);
+    T *stored = itemAt(cell);
+    T item(std::move(*stored));
+    stored->~T();
+    cell.sequence.store(pos + mQueueLimit, std::memory_order_release);
+    mHead.store(pos + 1, std::memory_order_release);
+    return item;
+}
+
+template <typename T>
+T BoundedMpscQueue<T>::wait_pop() {
+    uint64_t pos = mHead.load(std::memory_order_relaxed);
+    waitForItem(pos, nullptr /* deadline */);
+    return takeItem(pos);
+}
+
+template <typename T>
+size_t BoundedMpscQueue<T>::drain(std::vector<T> *out, size_t max) {
+    uint64_t pos = mHead.load(std::memory_order_relaxed);
+    waitForItem(pos, nullptr /* deadline */);
+    return takeReady(pos, out, max);
+}
+
+template <typename T>
+size_t BoundedMpscQueue<T>::drain_for(std::vector<T> *out, size_t max,
+                                      std::chrono::nanoseconds timeout) {
+    uint64_t pos = mHead.load(std::memory_order_relaxed);
+    Clock::time_point deadline = Clock::now() + timeout;
+    if (!waitForItem(pos, &deadline)) {
+        return 0;
+    }
+    return takeReady(pos, out, max);
+}
+
+template <typename T>
+size_t BoundedMpscQueue<T>::takeReady(uint64_t pos, std::vector<T> *out, size_t max) {
+    size_t count = 0;
+    for (; count < max && isReady(pos); ++count, ++pos) {
+        out->push_back(takeItem(pos));
+    }
+    return count;
+}
+
+template <typename T>
+bool BoundedMpscQueue<T>::push(const T &item) {
+    return push(T(item));
+}
+
+template <typename T>
+bool BoundedMpscQueue<T>::push(T &&item) {
+    if (!enqueue(std::move(item))) {
+        return false;
+    }
+    wakeConsumer();
+    return true;
+}
+
+template <typename T>
+template <typename Iterator>
+size_t BoundedMpscQueue<T>::push_all(Iterator first, Iterator last) {
+    size_t count = 0;
+    for (; first != last && enqueue(*first); ++first) {
+        ++count;
+    }
+    if (count > 0) {
+        wakeConsumer();
+    }
+    return count;
+}
+
+template <typename T>
+template <typename U>
+bool BoundedMpscQueue<T>::enqueue(U &&item) {
+    if (mQueueLimit == 0) {
+        return false;
+    }
+
+    uint64_t pos = mTail.load(std::memory_order_relaxed);
+    Cell *cell;
+    for (;;) {
+        cell = &cellAt(pos);
+        uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+        if (sequence == pos) {
+            if (mTail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (sequence < pos) {
+            return false;  // the consumer hasn't freed this slot yet
+        } else {
+            pos = mTail.load(std::memory_order_relaxed);
+        }
+    }
+
+    new (&cell->storage) T(std::forward<U>(item));
+    // Sequentially consistent, like the store and load in waitForItem():
+    // either the consumer sees the item before sleeping or wakeConsumer()
+    // sees that it sleeps.
+    cell->sequence.store(pos + 1);
+    return true;
+}
+
+template <typename T>
+void BoundedMpscQueue<T>::wakeConsumer() {
+    if (mConsumerWaiting.load() != 0 && mConsumerWaiting.exchange(0) != 0) {
+        futexWake(&mConsumerWaiting);
+    }
+}
+
+template <typename T>
+size_t BoundedMpscQueue<T>::size() {
+    uint64_t head = mHead.load();
+    uint64_t tail = mTail.load();
+    return tail > head ? tail - head : 0;
+}
+
 } // namespace details
 } // namespace hardware
 } // namespace android
@@ -17,20 +17,178 @@
 #define ANDROID_HIDL_TASK_RUNNER_H
 
 #include "SynchronizedQueue.h"
+#include <chrono>
+#include <cstddef>
+#include <functional>
 #include <memory>
+#include <new>
 #include <thread>
+#include <type_traits>
+#include <utility>
 
 namespace android {
 namespace hardware {
 namespace details {
 
 /*
- * A background infinite loop that runs the Tasks push()'ed.
- * Equivalent to a simple single-threaded Looper.
+ * A move-only void() callable. Unlike std::function it can hold move-only
+ * targets, and any target of up to InlineSize bytes is stored in the task
+ * itself, so creating and moving it doesn't allocate. Larger targets, and
+ * those that may throw when moved, are put on the heap.
+ */
+template <size_t InlineSize>
+class MoveOnlyTask {
+public:
+    MoveOnlyTask() noexcept : mOps(nullptr) {}
+    MoveOnlyTask(std::nullptr_t) noexcept : mOps(nullptr) {}
+
+    template <typename F,
+              typename = typename std::enable_if<
+                      !std::is_same<typename std::decay<F>::type, MoveOnlyTask>::value &&
+                      !std::is_same<typename std::decay<F>::type, std::nullptr_t>::value>::type>
+    MoveOnlyTask(F &&f) : mOps(nullptr) {
+        using Target = typename std::decay<F>::type;
+        if (!isNull(f)) {
+            init<Target>(std::forward<F>(f),
+                         std::integral_constant<bool, fitsInline<Target>()>());
+        }
+    }
+
+    MoveOnlyTask(MoveOnlyTask &&other) noexcept : mOps(nullptr) {
+        *this = std::move(other);
+    }
+
+    MoveOnlyTask &operator=(MoveOnlyTask &&other) noexcept {
+        if (this != &other) {
+            reset();
+            if (other.mOps != nullptr) {
+                other.mOps->relocate(&other.mStorage, &mStorage);
+                mOps = other.mOps;
+                other.mOps = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    MoveOnlyTask(const MoveOnlyTask &) = delete;
+    MoveOnlyTask &operator=(const MoveOnlyTask &) = delete;
+
+    ~MoveOnlyTask() {
+        reset();
+    }
+
+    explicit operator bool() const {
+        return mOps != nullptr;
+    }
+
+    void operator()() {
+        mOps->invoke(&mStorage);
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void *storage);
+        // Move the target to uninitialized storage and destroy the original.
+        void (*relocate)(void *from, void *to);
+        void (*destroy)(void *storage);
+    };
+
+    using Storage = typename std::aligned_storage<
+            (InlineSize > sizeof(void *) ? InlineSize : sizeof(void *)),
+            alignof(std::max_align_t)>::type;
+
+    template <typename Target>
+    static constexpr bool fitsInline() {
+        return sizeof(Target) <= sizeof(Storage) && alignof(Target) <= alignof(Storage) &&
+               std::is_nothrow_move_constructible<Target>::value;
+    }
+
+    template <typename Target>
+    struct InlineOps {
+        static void invoke(void *storage) {
+            (*static_cast<Target *>(storage))();
+        }
+        static void relocate(void *from, void *to) {
+            Target *target = static_cast<Target *>(from);
+            new (to) Target(std::move(*target));
+            target->~Target();
+        }
+        static void destroy(void *storage) {
+            static_cast<Target *>(storage)->~Target();
+        }
+        static const Ops kOps;
+    };
+
+    template <typename Target>
+    struct HeapOps {
+        static void invoke(void *storage) {
+            (**static_cast<Target **>(storage))();
+        }
+        static void relocate(void *from, void *to) {
+            *static_cast<Target **>(to) = *static_cast<Target **>(from);
+        }
+        static void destroy(void *storage) {
+            delete *static_cast<Target **>(storage);
+        }
+        static const Ops kOps;
+    };
+
+    // Empty std::functions and null function pointers make empty tasks.
+    template <typename Target>
+    static bool isNull(const Target &) { return false; }
+    template <typename Signature>
+    static bool isNull(const std::function<Signature> &f) { return !f; }
+    template <typename R, typename... Args>
+    static bool isNull(R (*f)(Args...)) { return f == nullptr; }
+
+    template <typename Target, typename F>
+    void init(F &&f, std::true_type /* fitsInline */) {
+        new (&mStorage) Target(std::forward<F>(f));
+        mOps = &InlineOps<Target>::kOps;
+    }
+
+    template <typename Target, typename F>
+    void init(F &&f, std::false_type /* fitsInline */) {
+        *reinterpret_cast<Target **>(&mStorage) = new Target(std::forward<F>(f));
+        mOps = &HeapOps<Target>::kOps;
+    }
+
+    void reset() {
+        if (mOps != nullptr) {
+            mOps->destroy(&mStorage);
+            mOps = nullptr;
+        }
+    }
+
+    const Ops *mOps;
+    Storage mStorage;
+};
+
+template <size_t InlineSize>
+template <typename Target>
+const typename MoveOnlyTask<InlineSize>::Ops MoveOnlyTask<InlineSize>::InlineOps<Target>::kOps = {
+        &InlineOps<Target>::invoke, &InlineOps<Target>::relocate, &InlineOps<Target>::destroy};
+
+template <size_t InlineSize>
+template <typename Target>
+const typename MoveOnlyTask<InlineSize>::Ops MoveOnlyTask<InlineSize>::HeapOps<Target>::kOps = {
+        &HeapOps<Target>::invoke, &HeapOps<Target>::relocate, &HeapOps<Target>::destroy};
+
+/*
+ * A background loop that runs the Tasks push()'ed.
+ * Equivalent to a simple single-threaded Looper, unless started with
+ * several workers. Worker threads are only created by push() and exit again
+ * once they have been idle for the idle timeout.
  */
 class TaskRunner {
 public:
-    using Task = std::function<void(void)>;
+    /*
+     * Room for a few captured sp<>s and hidl_vecs, or a whole std::function.
+     */
+    static constexpr size_t kInlineTaskSize = 48;
+    using Task = MoveOnlyTask<kInlineTaskSize>;
+
+    static constexpr std::chrono::milliseconds kDefaultIdleTimeout{10000};
 
     /* Create an empty task runner. Nothing will be done until start() is called. */
     TaskRunner();
@@ -42,20 +200,64 @@ public:
      */
     ~TaskRunner();
 
+    /*
+     * Sets how long a worker thread waits for new tasks before it exits; the
+     * next push() starts a new one. std::chrono::nanoseconds::max() keeps
+     * workers around forever. Takes effect on the next start().
+     */
+    void setIdleTimeout(std::chrono::nanoseconds timeout);
+
     /*
      * Sets the queue limit. Fails the push operation once the limit is reached.
-     * Then kicks off the loop.
+     * Then kicks off the loop, whose thread starts with the first push().
      */
     void start(size_t limit);
 
+    /*
+     * Like start(limit), but runs tasks on workerCount threads. Each worker
+     * has its own queue and idle workers steal tasks from busy ones, so a slow
+     * task only holds up the tasks behind it while all workers are busy.
+     * Tasks may then run concurrently and out of order, except those pushed
+     * with the same key. limit applies to all tasks that haven't started yet,
+     * with or without a key. Another worker is started by a push() that finds
+     * none of the running ones waiting, up to workerCount.
+     */
+    void start(size_t limit, size_t workerCount);
+
+    /*
+     * Like start(limit), but with a BoundedMpscQueue, so that push() never
+     * waits for a lock that the worker or another pushing thread holds.
+     */
+    void startLockFree(size_t limit);
+
     /*
      * Add a task. Return true if successful, false if
      * the queue's size exceeds limit or t doesn't contain a callable target.
      */
-    bool push(const Task &t);
+    bool push(Task &&t);
+
+    /*
+     * Like push(t), but t starts only after all tasks previously pushed with
+     * the same key have finished.
+     */
+    bool push(uint64_t key, Task &&t);
+
+    /*
+     * Add a task made from f. Doesn't allocate if f fits in kInlineTaskSize.
+     */
+    template <typename F>
+    bool emplace(F &&f) {
+        return push(Task(std::forward<F>(f)));
+    }
 
 private:
-    std::shared_ptr<SynchronizedQueue<Task>> mQueue;
+    class Impl;
+    template <typename Queue>
+    class SerialImpl;
+    class PoolImpl;
+
+    std::shared_ptr<Impl> mImpl;
+    std::chrono::nanoseconds mIdleTimeout{kDefaultIdleTimeout};
 };
 
 } // namespace details
@@ -17,11 +17,22 @@
 #define LOG_TAG "LibHidlTest"
 
 #include <android-base/logging.h>
+#include <array>
+#include <fcntl.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <hidl/ConcurrentMap.h>
+#include <hidl/DescriptorIds.h>
+#include <hidl/HidlBinderSupport.h>
 #include <hidl/HidlSupport.h>
+#include <hidl/MQDescriptor.h>
 #include <hidl/Status.h>
 #include <hidl/TaskRunner.h>
+#include <future>
+#include <memory>
+#include <strings.h>
+#include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
 #define EXPECT_ARRAYEQ(__a1__, __a2__, __size__) EXPECT_TRUE(isArrayEqual(__a1__, __a2__, __size__))
@@ -53,6 +64,205 @@ public:
     }
 };
 
+TEST_F(LibHidlTest, SharedHandleTest) {
+    using android::hardware::hidl_handle;
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    native_handle_t *nh = native_handle_create(1 /* numFds */, 0 /* numInts */);
+    nh->data[0] = fds[0];
+
+    std::unique_ptr<hidl_handle> original = std::make_unique<hidl_handle>();
+    original->setToShared(nh);
+    EXPECT_EQ(nh, original->getNativeHandle());
+    hidl_handle copy = *original;
+    EXPECT_EQ(nh, copy.getNativeHandle());  // not cloned
+    hidl_handle assigned;
+    assigned = copy;
+    EXPECT_EQ(nh, assigned.getNativeHandle());
+    hidl_handle moved = std::move(assigned);
+    EXPECT_EQ(nh, moved.getNativeHandle());
+    EXPECT_EQ(nullptr, assigned.getNativeHandle());
+
+    original.reset();
+    copy = nullptr;
+    EXPECT_NE(-1, fcntl(fds[0], F_GETFD));  // moved still refers to it
+
+    hidl_handle unshared(moved.getNativeHandle());
+    hidl_handle clone = unshared;  // doesn't own nh, so clones
+    EXPECT_NE(nh, clone.getNativeHandle());
+
+    // A Parcel can carry any padding next to a handle of its own, including
+    // the share id of a live shared handle.
+    native_handle_t *received = native_handle_create(0 /* numFds */, 0 /* numInts */);
+    alignas(hidl_handle) char bytes[sizeof(hidl_handle)];
+    memcpy(bytes, static_cast<const void *>(&moved), sizeof(bytes));
+    memcpy(bytes, &received, sizeof(received));  // mHandle comes first
+    for (bool garbage : {false, true}) {
+        if (garbage) {
+            memset(bytes + sizeof(received), 0xff, sizeof(bytes) - sizeof(received));
+        }
+        const hidl_handle &inParcel = *reinterpret_cast<const hidl_handle *>(bytes);
+        hidl_handle receivedCopy = inParcel;
+        EXPECT_NE(received, receivedCopy.getNativeHandle());  // cloned
+        hidl_handle receivedCopyCopy = receivedCopy;
+        EXPECT_NE(receivedCopy.getNativeHandle(), receivedCopyCopy.getNativeHandle());
+    }
+    native_handle_delete(received);
+    EXPECT_NE(-1, fcntl(fds[0], F_GETFD));  // moved's reference is untouched
+
+    moved = nullptr;
+    EXPECT_EQ(-1, fcntl(fds[0], F_GETFD));
+    close(fds[1]);
+}
+
+TEST_F(LibHidlTest, MQDescriptorLayoutTest) {
+    using android::hardware::MQDescriptorSync;
+    using android::hardware::MQLayout;
+    using Desc = MQDescriptorSync<uint8_t>;
+
+    Desc packed(100 /* bufferSize */, nullptr, 1 /* messageSize */, true);
+    ASSERT_EQ(4u, packed.countGrantors());
+    EXPECT_EQ(0u, packed.grantors()[Desc::READPTRPOS].offset);
+    EXPECT_EQ(8u, packed.grantors()[Desc::WRITEPTRPOS].offset);
+    EXPECT_EQ(16u, packed.grantors()[Desc::DATAPTRPOS].offset);
+    EXPECT_EQ(120u, packed.grantors()[Desc::EVFLAGWORDPOS].offset);
+    EXPECT_EQ(100u, packed.getSize());
+
+    MQLayout layout;
+    layout.configureEventFlag = true;
+    layout.grantorAlignment = MQLayout::kCacheLineSize;
+    Desc separated(100 /* bufferSize */, nullptr, 1 /* messageSize */, layout);
+    ASSERT_EQ(4u, separated.countGrantors());
+    EXPECT_EQ(0u, separated.grantors()[Desc::READPTRPOS].offset);
+    EXPECT_EQ(64u, separated.grantors()[Desc::WRITEPTRPOS].offset);
+    EXPECT_EQ(128u, separated.grantors()[Desc::DATAPTRPOS].offset);
+    EXPECT_EQ(256u, separated.grantors()[Desc::EVFLAGWORDPOS].offset);
+    EXPECT_EQ(100u, separated.getSize());
+}
+
+TEST_F(LibHidlTest, MQDescriptorMultiReadTest) {
+    using android::hardware::MQDescriptorMultiRead;
+    using android::hardware::MQLayout;
+    using ::testing::HasSubstr;
+    using Desc = MQDescriptorMultiRead<uint16_t>;
+
+    MQLayout layout;
+    layout.readerCount = 3;
+    Desc desc(64 /* bufferSize */, nullptr, sizeof(uint16_t), layout);
+    EXPECT_EQ(3u, desc.getReaderCount());
+    ASSERT_EQ(6u, desc.countGrantors());
+    EXPECT_EQ(size_t(Desc::READPTRPOS), Desc::readPtrGrantorIndex(0));
+    EXPECT_EQ(4u, Desc::readPtrGrantorIndex(1));
+    EXPECT_EQ(5u, Desc::readPtrGrantorIndex(2));
+    EXPECT_EQ(sizeof(uint32_t), desc.grantors()[Desc::EVFLAGWORDPOS].extent);
+    EXPECT_EQ(88u, desc.grantors()[4].offset);
+    EXPECT_EQ(96u, desc.grantors()[5].offset);
+    EXPECT_EQ(sizeof(uint64_t), desc.grantors()[5].extent);
+    EXPECT_THAT(toString(desc), HasSubstr("3 reader(s)"));
+
+    Desc single(64 /* bufferSize */, nullptr, sizeof(uint16_t));
+    EXPECT_EQ(1u, single.getReaderCount());
+    EXPECT_EQ(3u, single.countGrantors());
+}
+
+TEST_F(LibHidlTest, MQDescriptorMirroredTest) {
+    using android::hardware::kGrantorMirrored;
+    using android::hardware::MQDescriptorSync;
+    using android::hardware::MQLayout;
+    using Desc = MQDescriptorSync<uint8_t>;
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+
+    MQLayout layout;
+    layout.configureEventFlag = true;
+    layout.mirrorData = true;
+    Desc desc(100 /* bufferSize */, nullptr, 1 /* messageSize */, layout);
+    EXPECT_TRUE(desc.isDataMirrored());
+    const auto &data = desc.grantors()[Desc::DATAPTRPOS];
+    EXPECT_EQ(kGrantorMirrored, data.flags);
+    EXPECT_EQ(pageSize, data.offset);
+    EXPECT_EQ(pageSize, data.extent);
+    EXPECT_EQ(pageSize, desc.getSize());
+    EXPECT_EQ(0u, desc.grantors()[Desc::WRITEPTRPOS].flags);
+    EXPECT_EQ(2 * pageSize, desc.grantors()[Desc::EVFLAGWORDPOS].offset);
+
+    EXPECT_FALSE(Desc(100 /* bufferSize */, nullptr, 1 /* messageSize */).isDataMirrored());
+}
+
+TEST_F(LibHidlTest, MQDescriptorSeparateDataFdTest) {
+    using android::hardware::MQDescriptorSync;
+    using android::hardware::MQLayout;
+    using Desc = MQDescriptorSync<uint8_t>;
+    constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+    MQLayout layout;
+    layout.configureEventFlag = true;
+    layout.separateDataFd = true;
+    layout.dataAlignment = kHugePageSize;
+    Desc desc(kHugePageSize + 1 /* bufferSize */, nullptr, 1 /* messageSize */, layout);
+    const auto &data = desc.grantors()[Desc::DATAPTRPOS];
+    EXPECT_EQ(1u, data.fdIndex);
+    EXPECT_EQ(0u, data.offset);
+    EXPECT_EQ(2 * kHugePageSize, data.extent);
+    for (size_t i : {Desc::READPTRPOS, Desc::WRITEPTRPOS, Desc::EVFLAGWORDPOS}) {
+        EXPECT_EQ(0u, desc.grantors()[i].fdIndex);
+    }
+    EXPECT_EQ(16u, desc.grantors()[Desc::EVFLAGWORDPOS].offset);
+    EXPECT_EQ(20u, desc.getMemorySize(0));
+    EXPECT_EQ(2 * kHugePageSize, desc.getMemorySize(1));
+
+    Desc packed(100 /* bufferSize */, nullptr, 1 /* messageSize */, true);
+    EXPECT_EQ(124u, packed.getMemorySize(0));
+    EXPECT_EQ(0u, packed.getMemorySize(1));
+}
+
+TEST_F(LibHidlTest, MQDescriptorMoveTest) {
+    using android::hardware::MQDescriptorSync;
+    using Desc = MQDescriptorSync<uint8_t>;
+    static_assert(std::is_nothrow_move_constructible<Desc>::value, "");
+    static_assert(std::is_nothrow_move_assignable<Desc>::value, "");
+
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    native_handle_t *nh = native_handle_create(1 /* numFds */, 0 /* numInts */);
+    nh->data[0] = fds[0];
+
+    Desc original(100 /* bufferSize */, nh, 1 /* messageSize */);
+    const void *grantors = original.grantors().data();
+    Desc moved(std::move(original));
+    EXPECT_EQ(nh, moved.handle());  // not dup()ed
+    EXPECT_EQ(grantors, moved.grantors().data());
+    EXPECT_EQ(100u, moved.getSize());
+    EXPECT_FALSE(original.isHandleValid());
+    EXPECT_EQ(0u, original.countGrantors());
+
+    Desc assigned;
+    assigned = std::move(moved);
+    EXPECT_EQ(nh, assigned.handle());
+    EXPECT_EQ(3u, assigned.countGrantors());
+    EXPECT_FALSE(moved.isHandleValid());
+    EXPECT_NE(-1, fcntl(fds[0], F_GETFD));
+
+    assigned = Desc();
+    EXPECT_EQ(-1, fcntl(fds[0], F_GETFD));
+    close(fds[1]);
+}
+
+TEST_F(LibHidlTest, MQDescriptorVariableLengthTest) {
+    using android::hardware::MQDescriptorVariableLength;
+    using android::hardware::MQRecordHeader;
+    using ::testing::HasSubstr;
+    using Desc = MQDescriptorVariableLength<uint8_t>;
+
+    Desc desc(1000 /* bufferSize */, nullptr, 16 /* record alignment */);
+    EXPECT_EQ(16u, desc.getQuantum());
+    EXPECT_EQ(1008u, desc.getSize());  // whole records
+    EXPECT_EQ(16u, desc.getRecordSize(0));
+    EXPECT_EQ(16u, desc.getRecordSize(8));
+    EXPECT_EQ(32u, desc.getRecordSize(9));
+    EXPECT_EQ(sizeof(MQRecordHeader) + 3, Desc().getRecordSize(3));
+    EXPECT_THAT(toString(desc), HasSubstr("fmq_varlen"));
+}
+
 TEST_F(LibHidlTest, StringTest) {
     using android::hardware::hidl_string;
     hidl_string s; // empty constructor
@@ -149,6 +359,30 @@ TEST_F(LibHidlTest, StringTest) {
     EXPECT_FALSE(hs2 <= hs1);
 }
 
+TEST_F(LibHidlTest, StringLiteralTest) {
+    using android::hardware::hidl_string;
+    using android::hardware::operator""_hs;
+    using android::hardware::details::kStaticStorage;
+
+    static const char kName[] = "default";
+    static const hidl_string kDefault(kName, sizeof(kName) - 1, kStaticStorage);
+    EXPECT_EQ(kName, kDefault.c_str()); // not copied
+    EXPECT_EQ(7u, kDefault.size());
+
+    hidl_string literal = "default"_hs;
+    EXPECT_EQ(kDefault, literal);
+    EXPECT_EQ(7u, literal.size());
+    hidl_string withNul = "a\0b"_hs;
+    EXPECT_EQ(3u, withNul.size());
+
+    hidl_string copy = literal; // copies are owned
+    EXPECT_NE(literal.c_str(), copy.c_str());
+    EXPECT_EQ(literal, copy);
+    literal = "other";
+    EXPECT_STREQ("other", literal.c_str());
+    EXPECT_STREQ("default", kName);
+}
+
 TEST_F(LibHidlTest, MemoryTest) {
     using android::hardware::hidl_memory;
 
@@ -286,6 +520,326 @@ TEST_F(LibHidlTest, VecRangeCtorTest) {
     EXPECT_EQ(sum, 1 + 2 + 3);
 }
 
+TEST_F(LibHidlTest, VecCapacityTest) {
+    using android::hardware::hidl_string;
+    using android::hardware::hidl_vec;
+
+    hidl_vec<int32_t> hv;
+    EXPECT_EQ(0u, hv.capacity());
+    for (int32_t i = 0; i < 100; ++i) {
+        hv.push_back(i);
+        EXPECT_GE(hv.capacity(), hv.size());
+    }
+    EXPECT_EQ(100u, hv.size());
+    EXPECT_EQ(128u, hv.capacity());
+    for (int32_t i = 0; i < 100; ++i) {
+        EXPECT_EQ(i, hv[i]);
+    }
+
+    hv.shrink_to_fit();
+    EXPECT_EQ(100u, hv.capacity());
+    EXPECT_EQ(99, hv[99]);
+
+    hv.resize(10);
+    EXPECT_EQ(10u, hv.size());
+    hv.reserve(20);
+    EXPECT_EQ(32u, hv.capacity());
+    const int32_t *data = hv.data();
+    hv.resize(20);
+    EXPECT_EQ(data, hv.data()); // no reallocation within capacity
+    EXPECT_EQ(9, hv[9]);
+    EXPECT_EQ(0, hv[19]);
+
+    hidl_vec<hidl_string> strings;
+    strings.emplace_back("foo", 2);
+    strings.push_back(strings[0]); // element of the vector itself
+    strings.emplace_back(strings[1]);
+    EXPECT_EQ(3u, strings.size());
+    EXPECT_EQ(4u, strings.capacity());
+    EXPECT_EQ(hidl_string("fo"), strings[2]);
+
+    // copies don't keep spare capacity, moves do
+    hidl_vec<hidl_string> copy = strings;
+    EXPECT_EQ(3u, copy.capacity());
+    hidl_vec<hidl_string> moved = std::move(strings);
+    EXPECT_EQ(4u, moved.capacity());
+    moved.push_back("bar");
+    EXPECT_EQ(4u, moved.size());
+    EXPECT_EQ(hidl_string("bar"), moved[3]);
+
+    // external buffers are copied out when growing
+    int32_t array[] = {5, 6, 7};
+    hidl_vec<int32_t> external;
+    external.setToExternal(array, 3);
+    EXPECT_EQ(3u, external.capacity());
+    external.push_back(8);
+    EXPECT_NE(array, external.data());
+    EXPECT_ARRAYEQ(external, array, 3);
+    EXPECT_EQ(8, external[3]);
+}
+
+// Like the structs hidl-gen generates, opted in to memcmp equality.
+struct OptedInPoint {
+    int32_t x;
+    int32_t y;
+    bool operator==(const OptedInPoint &other) const {
+        return x == other.x && y == other.y;
+    }
+};
+
+namespace android {
+namespace hardware {
+namespace details {
+template<>
+struct is_bitwise_comparable<OptedInPoint> : std::true_type {};
+}  // namespace details
+}  // namespace hardware
+}  // namespace android
+
+// Padding-free, but not equal bitwise.
+struct CaseInsensitiveName {
+    const char *name;
+    bool operator==(const CaseInsensitiveName &other) const {
+        return strcasecmp(name, other.name) == 0;
+    }
+};
+
+TEST_F(LibHidlTest, VecTriviallyCopyableTest) {
+    using android::hardware::hidl_string;
+    using android::hardware::hidl_vec;
+
+    std::vector<uint8_t> blob(4096);
+    for (size_t i = 0; i < blob.size(); ++i) {
+        blob[i] = static_cast<uint8_t>(i * 7);
+    }
+    hidl_vec<uint8_t> hv = blob;
+    EXPECT_EQ(blob.size(), hv.size());
+    EXPECT_ARRAYEQ(hv, blob, blob.size());
+    hidl_vec<uint8_t> hv2(hv);
+    EXPECT_TRUE(hv == hv2);
+    hv2[4095]++;
+    EXPECT_TRUE(hv != hv2);
+    hv2.resize(4095);
+    hv.resize(4095);
+    EXPECT_TRUE(hv == hv2);
+    std::vector<uint8_t> back = hv;
+    EXPECT_ARRAYEQ(back, blob, 4095);
+
+    const int32_t array[] = {1, 2, 3};
+    hidl_vec<int32_t> fromRange(array, array + 3);
+    EXPECT_ARRAYEQ(fromRange, array, 3);
+    EXPECT_TRUE(fromRange == hidl_vec<int32_t>({1, 2, 3}));
+    EXPECT_TRUE(hidl_vec<int32_t>() == hidl_vec<int32_t>());
+
+    // -0.0 == 0.0, so floats must not be compared bitwise
+    hidl_vec<float> zeros{0.0f};
+    hidl_vec<float> negativeZeros{-0.0f};
+    EXPECT_TRUE(zeros == negativeZeros);
+
+    std::vector<bool> bits{true, false, true};
+    hidl_vec<bool> hbits = bits;
+    EXPECT_ARRAYEQ(hbits, bits, 3);
+    std::vector<bool> bitsBack = hbits;
+    EXPECT_EQ(bits, bitsBack);
+
+    std::vector<hidl_string> strings{"a", "b"};
+    hidl_vec<hidl_string> hstrings = strings;
+    EXPECT_ARRAYEQ(hstrings, strings, 2);
+    EXPECT_TRUE(hstrings == hidl_vec<hidl_string>({"a", "b"}));
+
+    using android::hardware::details::is_bitwise_comparable;
+    struct Packed { int32_t a; int32_t b; };
+    EXPECT_TRUE(is_bitwise_comparable<int32_t>::value);
+    EXPECT_FALSE(is_bitwise_comparable<float>::value);
+    EXPECT_FALSE(is_bitwise_comparable<Packed>::value);  // structs opt in
+    EXPECT_TRUE(is_bitwise_comparable<OptedInPoint>::value);
+    EXPECT_FALSE(is_bitwise_comparable<CaseInsensitiveName>::value);
+
+    hidl_vec<OptedInPoint> points{{1, 2}, {3, 4}};
+    EXPECT_TRUE(points == hidl_vec<OptedInPoint>({{1, 2}, {3, 4}}));
+    EXPECT_FALSE(points == hidl_vec<OptedInPoint>({{1, 2}, {3, 5}}));
+
+    // A user-written operator== is used even though the struct has no padding.
+    char upper[] = "NAME";
+    char lower[] = "name";
+    hidl_vec<CaseInsensitiveName> names{{upper}};
+    EXPECT_TRUE(names == hidl_vec<CaseInsensitiveName>({{lower}}));
+}
+
+TEST_F(LibHidlTest, VecMoveOnlyTest) {
+    using android::hardware::hidl_string;
+    using android::hardware::hidl_vec;
+
+    // Counts live objects to check that exactly the elements in [0, size)
+    // are constructed.
+    static int sLive = 0;
+    struct Tracked {
+        std::unique_ptr<int> value;
+        Tracked() : value(new int(0)) { ++sLive; }
+        explicit Tracked(int v) : value(new int(v)) { ++sLive; }
+        Tracked(Tracked &&other) noexcept : value(std::move(other.value)) { ++sLive; }
+        Tracked &operator=(Tracked &&other) noexcept {
+            value = std::move(other.value);
+            return *this;
+        }
+        ~Tracked() { --sLive; }
+    };
+
+    {
+        hidl_vec<Tracked> hv;
+        hv.reserve(4);
+        EXPECT_EQ(0, sLive);
+        for (int i = 0; i < 10; ++i) {
+            hv.emplace_back(i);
+        }
+        EXPECT_EQ(10, sLive);
+        Tracked t(10);
+        hv.push_back(std::move(t));
+        EXPECT_EQ(11u, hv.size());
+        for (int i = 0; i < 11; ++i) {
+            EXPECT_EQ(i, *hv[i].value);
+        }
+        hv.resize(3);
+        EXPECT_EQ(4, sLive); // 3 elements + t
+        hv.resize(5);
+        EXPECT_EQ(6, sLive);
+        EXPECT_EQ(2, *hv[2].value);
+        EXPECT_EQ(0, *hv[4].value);
+        hv.shrink_to_fit();
+        hv.resize(2);
+        EXPECT_EQ(3, sLive);
+
+        hidl_vec<Tracked> moved = std::move(hv);
+        EXPECT_EQ(1, *moved[1].value);
+    }
+    EXPECT_EQ(0, sLive);
+
+    // Growing moves hidl_strings rather than copying them.
+    hidl_vec<hidl_string> strings{"a", "b", "c"};
+    const char *buffer = strings[1].c_str();
+    strings.resize(1000);
+    EXPECT_EQ(buffer, strings[1].c_str());
+    EXPECT_TRUE(strings[999].empty());
+
+    // Vectors adopting new[]-allocated arrays still work.
+    hidl_vec<hidl_string> adopted;
+    adopted.setToExternal(new hidl_string[2]{"x", "y"}, 2, true /* shouldOwn */);
+    adopted.push_back("z");
+    EXPECT_EQ(hidl_string("y"), adopted[1]);
+    EXPECT_EQ(hidl_string("z"), adopted[2]);
+    hidl_string *released = adopted.releaseData();
+    EXPECT_EQ(hidl_string("z"), released[2]);
+    delete[] released;
+}
+
+static size_t sumVec(const android::hardware::hidl_vec<int32_t> &vec) {
+    size_t sum = 0;
+    for (int32_t i : vec) {
+        sum += i;
+    }
+    return sum;
+}
+
+TEST_F(LibHidlTest, VecStdVectorMoveTest) {
+    using android::hardware::hidl_string;
+    using android::hardware::hidl_vec;
+    using android::hardware::hidl_vec_view;
+
+    std::vector<hidl_string> strings{"a", "b", "c"};
+    const char *buffer = strings[1].c_str();
+    hidl_vec<hidl_string> hv = std::move(strings); // move constructor from std::vector
+    EXPECT_TRUE(strings.empty());
+    EXPECT_EQ(3u, hv.size());
+    EXPECT_EQ(buffer, hv[1].c_str());
+
+    std::vector<hidl_string> back = std::move(hv); // rvalue cast
+    EXPECT_EQ(0u, hv.size());
+    EXPECT_EQ(3u, back.size());
+    EXPECT_EQ(buffer, back[1].c_str());
+
+    hv = std::move(back); // move = from std::vector
+    std::vector<hidl_string> released = hv.releaseToVector();
+    EXPECT_EQ(0u, hv.size());
+    EXPECT_EQ(buffer, released[1].c_str());
+
+    // external buffers are copied, not moved from
+    hidl_string external[] = {"x", "y"};
+    hv.setToExternal(external, 2);
+    std::vector<hidl_string> copied = hv.releaseToVector();
+    EXPECT_EQ(hidl_string("y"), copied[1]);
+    EXPECT_EQ(hidl_string("y"), external[1]);
+
+    std::vector<bool> bits{true, false};
+    hidl_vec<bool> hbits = std::move(bits);
+    EXPECT_TRUE(hbits[0]);
+    EXPECT_FALSE(hbits[1]);
+
+    std::vector<int32_t> ints{1, 2, 3};
+    hidl_vec_view<int32_t> view(ints);
+    EXPECT_EQ(ints.data(), view.get().data());
+    EXPECT_EQ(3u, view.get().size());
+    EXPECT_EQ(6u, sumVec(hidl_vec_view<int32_t>(ints)));
+    // Temporaries would leave the view dangling.
+    static_assert(!std::is_constructible<hidl_vec_view<int32_t>, std::vector<int32_t>>::value,
+                  "hidl_vec_view must not view a temporary std::vector");
+}
+
+TEST_F(LibHidlTest, ArenaTest) {
+    using android::hardware::hidl_arena;
+    using android::hardware::hidl_string;
+    using android::hardware::hidl_vec;
+
+    hidl_arena arena;
+    hidl_string heapCopy;
+    hidl_vec<hidl_string> heapStrings;
+    const char *first;
+    {
+        hidl_string s1;
+        hidl_string s2;
+        s1.setToArena("foo", 3, arena);
+        s2.setToArena("bar", 3, arena);
+        first = s1.c_str();
+        EXPECT_EQ(first + 4, s2.c_str()); // allocated back to back
+        EXPECT_EQ(hidl_string("foo"), s1);
+
+        hidl_string plain("plain"); // not placed in the arena
+        EXPECT_NE(first + 8, plain.c_str());
+
+        // Copies out of the arena are heap-owned and outlive it.
+        heapCopy = s1;
+        EXPECT_NE(s1.c_str(), heapCopy.c_str());
+
+        hidl_vec<hidl_string> strings;
+        strings.resize(2, arena);
+        strings[0] = s2;
+        strings[1] = hidl_string("a heap string moved in");
+        strings.push_back(s1); // grows into a heap buffer
+        EXPECT_EQ(3u, strings.size());
+        heapStrings = strings;
+        EXPECT_NE(strings.data(), heapStrings.data());
+
+        hidl_vec<uint8_t> blob;
+        std::vector<uint8_t> bytes(100 * 1024, 7); // larger than a chunk
+        blob.setToArena(bytes.data(), bytes.size(), arena);
+        EXPECT_EQ(7, blob[100 * 1024 - 1]);
+        hidl_vec<uint8_t> blobCopy = blob;
+        EXPECT_TRUE(blob == blobCopy);
+
+        uint8_t *released = blob.releaseData();
+        EXPECT_EQ(7, released[100 * 1024 - 1]);
+        delete[] released;
+    }
+    arena.reset();
+
+    hidl_string s;
+    s.setToArena("baz", 3, arena);
+    EXPECT_EQ(first, s.c_str()); // the arena was reset
+    EXPECT_EQ(hidl_string("foo"), heapCopy);
+    EXPECT_EQ(hidl_string("bar"), heapStrings[0]);
+    EXPECT_EQ(hidl_string("a heap string moved in"), heapStrings[1]);
+    EXPECT_EQ(hidl_string("foo"), heapStrings[2]);
+}
+
 TEST_F(LibHidlTest, ArrayTest) {
     using android::hardware::hidl_array;
     int32_t array[] = {5, 6, 7};
@@ -298,15 +852,498 @@ TEST_F(LibHidlTest, TaskRunnerTest) {
     using android::hardware::details::TaskRunner;
     TaskRunner tr;
     tr.start(1 /* limit */);
-    bool flag = false;
-    tr.push([&] {
+    std::promise<void> release;
+    std::promise<void> done;
+    std::future<void> finished = done.get_future();
+    EXPECT_TRUE(tr.push([&] {
+        release.get_future().wait();
+        done.set_value();
+    }));
+    // The task runs in the background, so push() returned before it finished.
+    EXPECT_EQ(std::future_status::timeout, finished.wait_for(std::chrono::milliseconds(0)));
+    release.set_value();
+    EXPECT_EQ(std::future_status::ready, finished.wait_for(std::chrono::seconds(5)));
+}
+
+TEST_F(LibHidlTest, TaskRunnerWorkersTest) {
+    using android::hardware::details::TaskRunner;
+    TaskRunner tr;
+    tr.start(100 /* limit */, 2 /* workerCount */);
+
+    // The first task only finishes once the second one ran on another worker.
+    std::promise<void> second;
+    std::promise<void> first;
+    EXPECT_TRUE(tr.push([&] {
+        second.get_future().wait();
+        first.set_value();
+    }));
+    EXPECT_TRUE(tr.push([&] { second.set_value(); }));
+    EXPECT_EQ(std::future_status::ready, first.get_future().wait_for(std::chrono::seconds(5)));
+}
+
+TEST_F(LibHidlTest, TaskRunnerWorkersLimitTest) {
+    using android::hardware::details::TaskRunner;
+    TaskRunner tr;
+    tr.start(2 /* limit */, 2 /* workerCount */);
+
+    // Keep both workers busy; running tasks don't count against the limit.
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    std::atomic<int> started{0};
+    for (int i = 0; i < 2; ++i) {
+        EXPECT_TRUE(tr.push([&started, released] {
+            started++;
+            released.wait();
+        }));
+    }
+    for (int i = 0; i < 5000 && started < 2; ++i) {
         usleep(1000);
-        flag = true;
+    }
+    ASSERT_EQ(2, started.load());
+
+    // Tasks with and without a key share the limit.
+    std::atomic<int> count{0};
+    EXPECT_TRUE(tr.push([&count] { count++; }));
+    EXPECT_TRUE(tr.push(1 /* key */, [&count] { count++; }));
+    EXPECT_FALSE(tr.push(2 /* key */, [&count] { count++; }));
+    EXPECT_FALSE(tr.push([&count] { count++; }));
+
+    release.set_value();
+    for (int i = 0; i < 5000 && count < 2; ++i) {
+        usleep(1000);
+    }
+    EXPECT_EQ(2, count.load());
+    std::promise<void> done;
+    EXPECT_TRUE(tr.push(2 /* key */, [&done] { done.set_value(); }));
+    EXPECT_EQ(std::future_status::ready, done.get_future().wait_for(std::chrono::seconds(5)));
+}
+
+TEST_F(LibHidlTest, TaskRunnerKeyTest) {
+    using android::hardware::details::TaskRunner;
+    constexpr int kCount = 200;
+    std::vector<int> order;
+    std::atomic<int> running{0};
+    std::atomic<bool> overlapped{false};
+    std::atomic<int> otherKey{0};
+    std::promise<void> done;
+    {
+        TaskRunner tr;
+        tr.start(1000 /* limit */, 4 /* workerCount */);
+        for (int i = 0; i < kCount; ++i) {
+            EXPECT_TRUE(tr.push(1 /* key */, [&, i] {
+                if (running++ != 0) {
+                    overlapped = true;
+                }
+                order.push_back(i);
+                running--;
+                if (i == kCount - 1) {
+                    done.set_value();
+                }
+            }));
+            EXPECT_TRUE(tr.push(2 /* key */, [&] { otherKey++; }));
+        }
+    }  // tasks still run after the TaskRunner is gone
+    ASSERT_EQ(std::future_status::ready, done.get_future().wait_for(std::chrono::seconds(5)));
+    for (int i = 0; i < 5000 && otherKey < kCount; ++i) {
+        usleep(1000);
+    }
+    ASSERT_EQ(kCount, otherKey);
+    EXPECT_FALSE(overlapped);
+    ASSERT_EQ(size_t(kCount), order.size());
+    for (int i = 0; i < kCount; ++i) {
+        EXPECT_EQ(i, order[i]);
+    }
+}
+
+TEST_F(LibHidlTest, BoundedMpscQueueTest) {
+    using android::hardware::details::BoundedMpscQueue;
+    BoundedMpscQueue<std::string> full(2 /* limit */);
+    EXPECT_TRUE(full.push("a"));
+    EXPECT_TRUE(full.push("b"));
+    EXPECT_FALSE(full.push("c"));
+    EXPECT_EQ(2u, full.size());
+    EXPECT_EQ("a", full.wait_pop());
+    EXPECT_TRUE(full.push("c"));  // wraps around
+    EXPECT_EQ("b", full.wait_pop());
+    EXPECT_EQ("c", full.wait_pop());
+    EXPECT_EQ(0u, full.size());
+    EXPECT_TRUE(full.push("left over"));  // destroyed with the queue
+
+    constexpr int kProducers = 4;
+    constexpr int kItems = 10000;
+    BoundedMpscQueue<std::pair<int, int>> queue(16 /* limit */);
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; ++p) {
+        producers.emplace_back([&queue, p] {
+            for (int i = 0; i < kItems; ++i) {
+                while (!queue.push({p, i})) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    std::vector<int> next(kProducers, 0);
+    for (int n = 0; n < kProducers * kItems; ++n) {
+        std::pair<int, int> item = queue.wait_pop();
+        ASSERT_EQ(next[item.first], item.second);  // per-producer order
+        next[item.first]++;
+    }
+    for (std::thread &t : producers) {
+        t.join();
+    }
+    EXPECT_EQ(0u, queue.size());
+}
+
+template <typename Queue>
+static void testQueueBatch() {
+    Queue queue(3 /* limit */);
+    std::vector<std::string> items{"a", "b", "c", "d"};
+    EXPECT_EQ(3u, queue.push_all(items.begin(), items.end()));  // "d" doesn't fit
+    EXPECT_EQ(0u, queue.push_all(items.begin(), items.end()));
+
+    std::vector<std::string> out;
+    EXPECT_EQ(2u, queue.drain(&out, 2));
+    EXPECT_EQ(1u, queue.drain(&out, 2));
+    EXPECT_EQ((std::vector<std::string>{"a", "b", "c"}), out);
+    EXPECT_EQ(0u, queue.size());
+
+    std::thread consumer([&queue, &out] {
+        while (out.size() < 5) {
+            queue.drain(&out, 8);
+        }
     });
-    usleep(500);
-    EXPECT_FALSE(flag);
-    usleep(1000);
-    EXPECT_TRUE(flag);
+    EXPECT_EQ(2u, queue.push_all(items.begin() + 2, items.end()));
+    consumer.join();
+    EXPECT_EQ((std::vector<std::string>{"a", "b", "c", "c", "d"}), out);
+}
+
+TEST_F(LibHidlTest, QueueBatchTest) {
+    using android::hardware::details::BoundedMpscQueue;
+    using android::hardware::details::SynchronizedQueue;
+    testQueueBatch<SynchronizedQueue<std::string>>();
+    testQueueBatch<BoundedMpscQueue<std::string>>();
+}
+
+TEST_F(LibHidlTest, TaskRunnerLockFreeTest) {
+    using android::hardware::details::TaskRunner;
+    std::promise<void> done;
+    std::vector<int> order;
+    {
+        TaskRunner tr;
+        tr.startLockFree(100 /* limit */);
+        for (int i = 0; i < 50; ++i) {
+            EXPECT_TRUE(tr.push([&, i] { order.push_back(i); }));
+        }
+        EXPECT_TRUE(tr.push([&] { done.set_value(); }));
+    }
+    ASSERT_EQ(std::future_status::ready, done.get_future().wait_for(std::chrono::seconds(5)));
+    ASSERT_EQ(50u, order.size());
+    for (int i = 0; i < 50; ++i) {
+        EXPECT_EQ(i, order[i]);
+    }
+}
+
+TEST_F(LibHidlTest, TaskRunnerIdleTest) {
+    using android::hardware::details::TaskRunner;
+    enum { kSerial, kLockFree, kPool };
+    for (int mode : {kSerial, kLockFree, kPool}) {
+        std::promise<void> first, second, last;
+        std::atomic<int> count{0};
+        {
+            TaskRunner tr;
+            tr.setIdleTimeout(std::chrono::milliseconds(5));
+            if (mode == kSerial) {
+                tr.start(10 /* limit */);
+            } else if (mode == kLockFree) {
+                tr.startLockFree(10 /* limit */);
+            } else {
+                tr.start(10 /* limit */, 3 /* workerCount */);
+            }
+            EXPECT_TRUE(tr.push([&] { first.set_value(); }));
+            ASSERT_EQ(std::future_status::ready,
+                      first.get_future().wait_for(std::chrono::seconds(5)));
+
+            usleep(20000);  // the worker exits meanwhile
+            EXPECT_TRUE(tr.push([&] { second.set_value(); }));
+            ASSERT_EQ(std::future_status::ready,
+                      second.get_future().wait_for(std::chrono::seconds(5)));
+
+            usleep(20000);
+            for (int i = 0; i < 5; ++i) {
+                EXPECT_TRUE(tr.push([&] { usleep(1000); count++; }));
+            }
+            EXPECT_TRUE(tr.push([&] { last.set_value(); }));
+        }
+        // Still run after the TaskRunner is gone.
+        ASSERT_EQ(std::future_status::ready,
+                  last.get_future().wait_for(std::chrono::seconds(5)));
+        // Workers of a pool may still be running the others.
+        for (int i = 0; i < 5000 && count < 5; ++i) {
+            usleep(1000);
+        }
+        EXPECT_EQ(5, count.load());
+    }
+}
+
+TEST_F(LibHidlTest, MoveOnlyTaskTest) {
+    using android::hardware::details::MoveOnlyTask;
+    using android::hardware::details::TaskRunner;
+    using Task = MoveOnlyTask<16>;
+
+    int calls = 0;
+    Task small([&calls] { calls++; });
+    std::array<char, 100> big{};
+    big[99] = 1;
+    Task large([&calls, big] { calls += big[99]; });  // too big for the inline buffer
+    std::unique_ptr<int> owned(new int(5));
+    Task moveOnly([&calls, owned = std::move(owned)] { calls += *owned; });
+
+    Task moved = std::move(large);
+    EXPECT_FALSE(large);
+    small();
+    moved();
+    moveOnly();
+    EXPECT_EQ(7, calls);
+
+    EXPECT_FALSE(Task(std::function<void()>()));
+    EXPECT_FALSE(Task(static_cast<void (*)()>(nullptr)));
+    EXPECT_FALSE(Task(nullptr));
+
+    std::promise<int> result;
+    std::unique_ptr<int> payload(new int(42));
+    TaskRunner tr;
+    EXPECT_FALSE(tr.emplace([] {}));  // not started
+    tr.start(10 /* limit */);
+    EXPECT_TRUE(tr.emplace([&result, payload = std::move(payload)] {
+        result.set_value(*payload);
+    }));
+    std::function<void()> empty;
+    EXPECT_FALSE(tr.push(empty));
+    EXPECT_EQ(42, result.get_future().get());
+}
+
+TEST_F(LibHidlTest, ReadMostlyMapTest) {
+    using android::hardware::ReadMostlyMap;
+    ReadMostlyMap<std::string, std::string> map;
+    EXPECT_EQ("none", map.get("a", "none"));
+    map.set("a", "1");
+    map.set("a", "2");
+    EXPECT_EQ("2", map.get("a", "none"));
+    map.set("b", "3");
+    EXPECT_EQ(1u, map.erase("b"));
+    EXPECT_EQ(0u, map.erase("b"));
+    EXPECT_EQ("none", map.get("b", "none"));
+
+    // Readers race with writes that grow the table several times.
+    constexpr int kEntries = 1000;
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; ++r) {
+        readers.emplace_back([&] {
+            while (!done.load()) {
+                std::string value = map.get("a", "none");
+                EXPECT_EQ("2", value);
+                value = map.get("key" + std::to_string(kEntries / 2), "");
+                EXPECT_TRUE(value.empty() || value == std::to_string(kEntries / 2));
+            }
+        });
+    }
+    for (int i = 0; i < kEntries; ++i) {
+        map.set("key" + std::to_string(i), std::to_string(i));
+    }
+    done = true;
+    for (std::thread &t : readers) {
+        t.join();
+    }
+    for (int i = 0; i < kEntries; ++i) {
+        EXPECT_EQ(std::to_string(i), map.get("key" + std::to_string(i), ""));
+    }
+    EXPECT_EQ("2", map.get("a", "none"));
+}
+
+TEST_F(LibHidlTest, ShardedConcurrentMapTest) {
+    using android::hardware::ShardedConcurrentMap;
+    ShardedConcurrentMap<const int*, int> map;
+    int keys[100];
+    for (int i = 0; i < 100; ++i) {
+        map.set(&keys[i], int(i));
+    }
+    EXPECT_EQ(100u, map.size());
+    EXPECT_EQ(42, map.get(&keys[42], -1));
+    {
+        auto lock = map.lock(&keys[42]);
+        EXPECT_EQ(42, map.getLocked(&keys[42], -1));
+        map.setLocked(&keys[42], 43);
+    }
+    EXPECT_EQ(0u, map.eraseIfEqual(&keys[42], 42));
+    EXPECT_EQ(1u, map.eraseIf(&keys[42], [](int value) { return value == 43; }));
+    EXPECT_EQ(-1, map.get(&keys[42], -1));
+    EXPECT_EQ(1u, map.erase(&keys[0]));
+    EXPECT_EQ(98u, map.size());
+}
+
+TEST_F(LibHidlTest, WeakKeyedMapTest) {
+    using android::hardware::WeakKeyedMap;
+    using android::RefBase;
+    using android::sp;
+    WeakKeyedMap<RefBase, int> map;
+    sp<RefBase> a = new RefBase();
+    sp<RefBase> b = new RefBase();
+    map.set(a, 1);
+    EXPECT_EQ(1, map.get(a, 0));
+    EXPECT_EQ(0, map.get(b, 0));
+    map.set(b, 2);
+    map.set(b, 3);
+    EXPECT_EQ(3, map.get(b, 0));
+    EXPECT_EQ(2u, map.size());
+    b.clear();
+
+    // Entries of dead objects are dropped as new ones come in.
+    for (int i = 0; i < 1000; ++i) {
+        sp<RefBase> temporary = new RefBase();
+        map.set(temporary, int(i));
+    }
+    EXPECT_LT(map.size(), 100u);
+    EXPECT_EQ(1, map.get(a, 0));
+}
+
+TEST_F(LibHidlTest, DescriptorIdTest) {
+    using namespace android::hardware::details;
+    using android::hardware::hidl_string;
+    EXPECT_EQ(kInvalidDescriptorId, findDescriptorId(hidl_string("test.unknown@1.0::IFoo")));
+
+    DescriptorId foo = internDescriptor("test.descriptor@1.0::IFoo");
+    EXPECT_NE(kInvalidDescriptorId, foo);
+    EXPECT_EQ(foo, internDescriptor("test.descriptor@1.0::IFoo"));
+    EXPECT_EQ(foo, findDescriptorId(hidl_string("test.descriptor@1.0::IFoo")));
+    EXPECT_EQ(foo, findDescriptorId(std::string("test.descriptor@1.0::IFoo")));
+
+    ConstructorMap<std::function<int()>> constructors;
+    EXPECT_FALSE(constructors.get(foo, nullptr));
+    constructors.set("test.descriptor@1.0::IFoo", [] { return 1; });
+    EXPECT_EQ(1, constructors.get(foo, nullptr)());
+    EXPECT_EQ(1, constructors.get("test.descriptor@1.0::IFoo", nullptr)());
+
+    // Many ids, so that several segments are used.
+    std::vector<DescriptorId> ids;
+    for (int i = 0; i < 500; ++i) {
+        std::string descriptor = "test.descriptor@1.0::IBar" + std::to_string(i);
+        constructors.set(std::string(descriptor), [i] { return i; });
+        ids.push_back(findDescriptorId(descriptor));
+    }
+    for (int i = 0; i < 500; ++i) {
+        EXPECT_EQ(i, constructors.get(ids[i], nullptr)());
+    }
+
+    EXPECT_EQ(1u, constructors.erase("test.descriptor@1.0::IFoo"));
+    EXPECT_EQ(0u, constructors.erase("test.descriptor@1.0::IFoo"));
+    EXPECT_FALSE(constructors.get(foo, nullptr));
+    EXPECT_EQ(foo, findDescriptorId(hidl_string("test.descriptor@1.0::IFoo")));  // ids stay
+}
+
+// A proxy that answers interfaceChain() itself and counts the calls.
+struct FakeRemoteBase : public android::hidl::base::V1_0::IBase {
+    bool isRemote() const override { return true; }
+    android::hardware::Return<void> interfaceChain(interfaceChain_cb cb) override {
+        ++chainCalls;
+        if (dead) {
+            return android::hardware::Status::fromStatusT(android::DEAD_OBJECT);
+        }
+        android::hardware::hidl_vec<android::hardware::hidl_string> types{
+                "test.cast@1.1::IFoo", "test.cast@1.0::IFoo", "android.hidl.base@1.0::IBase"};
+        cb(types);
+        return android::hardware::Void();
+    }
+    android::hardware::Return<void> interfaceDescriptor(interfaceDescriptor_cb cb) override {
+        cb("test.cast@1.1::IFoo");
+        return android::hardware::Void();
+    }
+
+    int chainCalls = 0;
+    bool dead = false;
+};
+
+// Keeps the death recipient, which a proxy would call once the server died.
+struct FakeRemoteBinder : public android::hardware::BHwBinder {
+    android::status_t linkToDeath(const android::sp<DeathRecipient>& recipient,
+            void* /* cookie */, uint32_t /* flags */) override {
+        if (dead) {
+            return android::DEAD_OBJECT;
+        }
+        deathRecipient = recipient;
+        return android::OK;
+    }
+
+    void die() {
+        dead = true;
+        deathRecipient->binderDied(this);
+    }
+
+    android::sp<DeathRecipient> deathRecipient;
+    bool dead = false;
+};
+
+TEST_F(LibHidlTest, InterfaceChainCacheHitTest) {
+    using android::hardware::details::canCastRemoteInterface;
+    android::sp<FakeRemoteBase> remote = new FakeRemoteBase();
+    android::sp<FakeRemoteBinder> binder = new FakeRemoteBinder();
+    EXPECT_TRUE(canCastRemoteInterface(binder, remote.get(), "test.cast@1.1::IFoo"));
+    EXPECT_TRUE(canCastRemoteInterface(binder, remote.get(), "test.cast@1.0::IFoo"));
+    EXPECT_FALSE(canCastRemoteInterface(binder, remote.get(), "test.cast@1.2::IFoo"));
+    EXPECT_EQ(1, remote->chainCalls);  // no further transactions
+}
+
+TEST_F(LibHidlTest, InterfaceChainCacheMissTest) {
+    using android::hardware::details::canCastRemoteInterface;
+    android::sp<FakeRemoteBase> remote = new FakeRemoteBase();
+    android::sp<FakeRemoteBinder> binder = new FakeRemoteBinder();
+
+    // A failed call isn't cached.
+    remote->dead = true;
+    EXPECT_FALSE(canCastRemoteInterface(binder, remote.get(), "test.cast@1.0::IFoo"));
+    EXPECT_FALSE(canCastRemoteInterface(binder, remote.get(), "test.cast@1.0::IFoo",
+            true /* emitError */).isOk());
+    EXPECT_EQ(2, remote->chainCalls);
+    remote->dead = false;
+    EXPECT_TRUE(canCastRemoteInterface(binder, remote.get(), "test.cast@1.0::IFoo"));
+    EXPECT_EQ(3, remote->chainCalls);
+
+    // Each binder has its own chain.
+    android::sp<FakeRemoteBinder> other = new FakeRemoteBinder();
+    EXPECT_TRUE(canCastRemoteInterface(other, remote.get(), "test.cast@1.0::IFoo"));
+    EXPECT_EQ(4, remote->chainCalls);
+    EXPECT_TRUE(canCastRemoteInterface(binder, remote.get(), "test.cast@1.0::IFoo"));
+    EXPECT_EQ(4, remote->chainCalls);
+
+    // Without death notifications, nothing is cached.
+    android::sp<android::hardware::BHwBinder> unlinkable = new android::hardware::BHwBinder();
+    EXPECT_TRUE(canCastRemoteInterface(unlinkable, remote.get(), "test.cast@1.0::IFoo"));
+    EXPECT_TRUE(canCastRemoteInterface(unlinkable, remote.get(), "test.cast@1.0::IFoo"));
+    EXPECT_EQ(6, remote->chainCalls);
+}
+
+TEST_F(LibHidlTest, InterfaceChainCacheDeadBinderTest) {
+    using android::hardware::details::canCastRemoteInterface;
+    android::sp<FakeRemoteBase> remote = new FakeRemoteBase();
+    android::sp<FakeRemoteBinder> binder = new FakeRemoteBinder();
+    EXPECT_TRUE(canCastRemoteInterface(binder, remote.get(), "test.cast@1.0::IFoo"));
+    EXPECT_EQ(1, remote->chainCalls);
+    ASSERT_NE(nullptr, binder->deathRecipient.get());
+
+    // Once the death notification arrives, casts fail like they did without
+    // the cache.
+    remote->dead = true;
+    binder->die();
+    EXPECT_FALSE(canCastRemoteInterface(binder, remote.get(), "test.cast@1.0::IFoo"));
+    EXPECT_FALSE(canCastRemoteInterface(binder, remote.get(), "test.cast@1.0::IFoo",
+            true /* emitError */).isOk());
+    EXPECT_EQ(3, remote->chainCalls);
+
+    // A chain fetched just before the death isn't cached again.
+    remote->dead = false;
+    EXPECT_TRUE(canCastRemoteInterface(binder, remote.get(), "test.cast@1.0::IFoo"));
+    EXPECT_TRUE(canCastRemoteInterface(binder, remote.get(), "test.cast@1.0::IFoo"));
+    EXPECT_EQ(5, remote->chainCalls);
 }
 
 TEST_F(LibHidlTest, StringCmpTest) {
@@ -322,6 +1359,85 @@ TEST_F(LibHidlTest, StringCmpTest) {
     EXPECT_FALSE(s != hs);
 }
 
+TEST_F(LibHidlTest, StringOrderTest) {
+    using android::hardware::hidl_string;
+    hidl_string abc = "abc";
+    hidl_string abd = "abd";
+    hidl_string ab = "ab";
+    EXPECT_TRUE(abc < abd);
+    EXPECT_TRUE(ab < abc);
+    EXPECT_TRUE("abb" < abc);
+    EXPECT_FALSE("abd" < abc);
+    EXPECT_TRUE(abc > "ab");
+    EXPECT_TRUE(std::string("abc") == abc);
+    EXPECT_TRUE(abc <= std::string("abd"));
+
+    hidl_string nul1("a\0b", 3);
+    hidl_string nul2("a\0c", 3);
+    EXPECT_NE(nul1, nul2);
+    EXPECT_TRUE(nul1 < nul2);
+    EXPECT_NE(nul1, "a");
+    EXPECT_TRUE(nul1 > "a");
+    EXPECT_EQ(nul1, std::string("a\0b", 3));
+#if __cplusplus >= 201703L
+    EXPECT_TRUE(abc == std::string_view("abc"));
+    EXPECT_TRUE(std::string_view("ab") < abc);
+    EXPECT_TRUE(nul1 != std::string_view("a"));
+#endif
+
+    std::unordered_map<hidl_string, int> map;
+    map["android.hardware.foo@1.0::IFoo"] = 1;
+    map[nul1] = 2;
+    map[nul2] = 3;
+    EXPECT_EQ(3u, map.size());
+    EXPECT_EQ(1, map[hidl_string("android.hardware.foo@1.0::IFoo")]);
+    EXPECT_EQ(2, map[hidl_string("a\0b", 3)]);
+    EXPECT_EQ(std::hash<hidl_string>()(abc), std::hash<hidl_string>()(hidl_string("abc")));
+}
+
+TEST_F(LibHidlTest, ToStringTest) {
+    using android::hardware::appendToString;
+    using android::hardware::hidl_array;
+    using android::hardware::hidl_string;
+    using android::hardware::hidl_vec;
+    using android::hardware::toString;
+    using android::hardware::details::toHexString;
+
+    EXPECT_EQ(std::to_string(INT64_MIN), toString(hidl_vec<int64_t>{INT64_MIN})
+            .substr(4, std::to_string(INT64_MIN).size()));
+    EXPECT_EQ("[3]{0, -2, 4294967295}", toString(hidl_vec<int64_t>{0, -2, UINT32_MAX}));
+    EXPECT_EQ("[2]{1, 0}", toString(hidl_vec<bool>{true, false}));
+    EXPECT_EQ("[2]{" + std::to_string(1.5f) + ", " + std::to_string(1e300) + "}",
+              toString(hidl_vec<double>{1.5f, 1e300}));
+    EXPECT_EQ("[2]{\"a\", \"b\"}", toString(hidl_vec<hidl_string>{"a", "b"}));
+    EXPECT_EQ("[2]{[1]{1}, [0]{}}", toString(hidl_vec<hidl_vec<uint8_t>>{{1}, {}}));
+
+    hidl_array<int32_t, 2, 3> array;
+    for (size_t i = 0; i < 2; ++i) {
+        for (size_t j = 0; j < 3; ++j) {
+            array[i][j] = i * 3 + j;
+        }
+    }
+    EXPECT_EQ("[2][3]{{0, 1, 2}, {3, 4, 5}}", toString(array));
+    EXPECT_EQ("[1]{\"x\"}", toString(hidl_array<hidl_string, 1>{{"x"}}));
+
+    std::string out = "prefix ";
+    appendToString(out, hidl_vec<int32_t>{7});
+    appendToString(out, 8);
+    EXPECT_EQ("prefix [1]{7}8", out);
+
+    EXPECT_EQ("0x1f", toHexString(0x1f));
+    EXPECT_EQ("1f", toHexString(0x1f, false));
+    EXPECT_EQ("0", toHexString(0));  // like std::showbase
+    EXPECT_EQ("0xffffffff", toHexString(-1));
+    EXPECT_EQ("0xffffffffffffffff", toHexString(uint64_t(-1)));
+    EXPECT_EQ("0xff", toHexString(uint8_t(0xff)));
+    EXPECT_EQ("0xffffffff", toHexString(int8_t(-1)));
+    std::ostringstream os;
+    os << std::showbase << std::hex << 'a' << 1.5;
+    EXPECT_EQ(os.str(), toHexString('a') + toHexString(1.5));
+}
+
 template <typename T>
 void great(android::hardware::hidl_vec<T>) {}
 
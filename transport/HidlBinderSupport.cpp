@@ -22,8 +22,13 @@
 #include <unistd.h>
 
 // C++ includes
+#include <algorithm>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <string>
+#include <vector>
 
 namespace android {
 namespace hardware {
@@ -204,5 +209,81 @@ void joinBinderRpcThreadpool() {
     IPCThreadState::self()->joinThreadPool();
 }
 
+namespace details {
+
+// Its address identifies the InterfaceChainCache attached to a binder.
+static const char kInterfaceChainId = 0;
+
+// Attached to a remote binder, holding its interface chain until the binder
+// dies. The binder keeps a reference to it while it is attached; casts still
+// using the chain keep their own reference to that.
+struct InterfaceChainCache : public IBinder::DeathRecipient {
+    void binderDied(const wp<IBinder>& /* who */) override {
+        std::atomic_store(&types, std::shared_ptr<const std::vector<std::string>>());
+    }
+
+    std::shared_ptr<const std::vector<std::string>> types;
+};
+
+static void releaseInterfaceChainCache(const void* id, void* object, void* /* cookie */) {
+    static_cast<InterfaceChainCache*>(object)->decStrong(id);
+}
+
+Return<bool> canCastRemoteInterface(const sp<IBinder>& binder,
+        ::android::hidl::base::V1_0::IBase* interface, const char* castTo, bool emitError) {
+    auto cache = static_cast<InterfaceChainCache*>(binder->findObject(&kInterfaceChainId));
+    std::shared_ptr<const std::vector<std::string>> chain;
+    if (cache != nullptr) {
+        chain = std::atomic_load(&cache->types);
+    }
+
+    if (chain == nullptr) {
+        auto types = std::make_shared<std::vector<std::string>>();
+        auto chainRet = interface->interfaceChain([&](const hidl_vec<hidl_string> &chainTypes) {
+            for (size_t i = 0; i < chainTypes.size(); i++) {
+                types->emplace_back(chainTypes[i].c_str(), chainTypes[i].size());
+            }
+        });
+
+        if (!chainRet.isOk()) {
+            // call fails, propagate the error if emitError
+            return emitError
+                    ? details::StatusOf<void, bool>(chainRet)
+                    : Return<bool>(false);
+        }
+        chain = types;
+
+        // A binder only gets one cache; once its chain is dropped, every cast
+        // calls interfaceChain() again, which fails like it did without one.
+        sp<InterfaceChainCache> newCache;
+        {
+            std::unique_lock<std::mutex> _lock(gInterfaceChainLock);
+            if (binder->findObject(&kInterfaceChainId) == nullptr) {
+                newCache = new InterfaceChainCache();
+                newCache->types = chain;
+                newCache->incStrong(&kInterfaceChainId);
+                binder->attachObject(&kInterfaceChainId, newCache.get(), nullptr /* cookie */,
+                        releaseInterfaceChainCache);
+            }
+        }
+        if (newCache != nullptr && binder->linkToDeath(newCache) != OK) {
+            // Already dead, so binderDied() won't be called.
+            newCache->binderDied(binder);
+        }
+    }
+
+    return std::find(chain->begin(), chain->end(), castTo) != chain->end();
+}
+
+void onBnObjectDestroyed(const void* /* id */, void* object, void* cookie) {
+    // toBinder() may have replaced the entry with a new binder meanwhile.
+    gBnMap.eraseIf(static_cast<::android::hidl::base::V1_0::IBase*>(object),
+            [cookie](const wp<BHwBinder>& bnObj) {
+                return bnObj.unsafe_get() == cookie;
+            });
+}
+
+}  // namespace details
+
 }  // namespace hardware
 }  // namespace android
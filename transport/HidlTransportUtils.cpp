@@ -16,6 +16,8 @@
 
 #include <hidl/HidlTransportUtils.h>
 
+#include <hidl/Static.h>
+
 namespace android {
 namespace hardware {
 namespace details {
@@ -55,6 +57,33 @@ std::string getDescriptor(::android::hidl::base::V1_0::IBase* interface) {
     return myDescriptor;
 }
 
+DescriptorId getDescriptorId(::android::hidl::base::V1_0::IBase* interface) {
+    DescriptorId id = kInvalidDescriptorId;
+    auto ret = interface->interfaceDescriptor([&](const hidl_string &types) {
+        id = findDescriptorId(types);
+    });
+    ret.isOk(); // ignored, return kInvalidDescriptorId if not isOk()
+    return id;
+}
+
+DescriptorId internDescriptor(const std::string &descriptor) {
+    std::unique_lock<std::mutex> _lock(gDescriptorIdsLock);
+    DescriptorId id = gDescriptorIds.get(descriptor, kInvalidDescriptorId);
+    if (id == kInvalidDescriptorId) {
+        id = ++gLastDescriptorId;
+        gDescriptorIds.set(std::string(descriptor), DescriptorId(id));
+    }
+    return id;
+}
+
+DescriptorId findDescriptorId(const hidl_string &descriptor) {
+    return gDescriptorIds.get(descriptor, kInvalidDescriptorId);
+}
+
+DescriptorId findDescriptorId(const std::string &descriptor) {
+    return gDescriptorIds.get(descriptor, kInvalidDescriptorId);
+}
+
 }  // namespace details
 }  // namespace hardware
 }  // namespace android
@@ -29,15 +29,21 @@ namespace details {
 Mutex gDefaultServiceManagerLock;
 sp<android::hidl::manager::V1_0::IServiceManager> gDefaultServiceManager;
 
-ConcurrentMap<std::string, std::function<sp<IBinder>(void *)>>
-        gBnConstructorMap{};
+std::mutex gDescriptorIdsLock;
+ReadMostlyMap<std::string, DescriptorId, DescriptorHash> gDescriptorIds{};
+DescriptorId gLastDescriptorId = kInvalidDescriptorId;
 
-ConcurrentMap<const ::android::hidl::base::V1_0::IBase*, wp<::android::hardware::BHwBinder>>
+std::mutex gInterfaceChainLock;
+
+ConstructorMap<std::function<sp<IBinder>(void *)>> gBnConstructorMap{};
+
+ShardedConcurrentMap<const ::android::hidl::base::V1_0::IBase*,
+                     wp<::android::hardware::BHwBinder>>
     gBnMap{};
 
-ConcurrentMap<wp<::android::hidl::base::V1_0::IBase>, SchedPrio> gServicePrioMap{};
+WeakKeyedMap<::android::hidl::base::V1_0::IBase, SchedPrio> gServicePrioMap{};
 
-ConcurrentMap<std::string, std::function<sp<::android::hidl::base::V1_0::IBase>(void *)>>
+ConstructorMap<std::function<sp<::android::hidl::base::V1_0::IBase>(void *)>>
         gBsConstructorMap;
 
 }  // namespace details
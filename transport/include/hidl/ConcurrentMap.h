@@ -16,8 +16,15 @@
 #ifndef ANDROID_HIDL_CONCURRENT_MAP_H
 #define ANDROID_HIDL_CONCURRENT_MAP_H
 
-#include <mutex>
+#include <atomic>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <utils/RefBase.h>
 
 namespace android {
 namespace hardware {
@@ -35,8 +42,9 @@ public:
         mMap[std::forward<K>(k)] = std::forward<V>(v);
     }
 
-    // get with the given default value.
-    const V &get(const K &k, const V &def) const {
+    // get with the given default value. Returns a copy, since the entry may
+    // be erased as soon as the lock is released.
+    V get(const K &k, const V &def) const {
         std::unique_lock<std::mutex> _lock(mMutex);
         const_iterator iter = mMap.find(k);
         if (iter == mMap.end()) {
@@ -81,6 +89,314 @@ public:
     std::map<K, V> mMap;
 };
 
+// Like ConcurrentMap, but unordered and split into shards with a lock each,
+// so that threads working on different keys rarely wait for each other.
+// lock(k) locks the shard of k, for a get and set of k that must be atomic.
+template<typename K, typename V, typename Hash = std::hash<K>>
+class ShardedConcurrentMap {
+private:
+    using size_type = size_t;
+
+public:
+    // Returns 1 if k wasn't set before, 0 if its value was replaced.
+    size_type set(K &&k, V &&v) {
+        Shard &shard = shardOf(k);
+        std::unique_lock<std::mutex> _lock(shard.mutex);
+        auto result = shard.map.emplace(std::forward<K>(k), V());
+        result.first->second = std::forward<V>(v);
+        return result.second ? 1 : 0;
+    }
+
+    // get with the given default value.
+    V get(const K &k, const V &def) const {
+        const Shard &shard = shardOf(k);
+        std::unique_lock<std::mutex> _lock(shard.mutex);
+        return getLocked(k, def);
+    }
+
+    size_type erase(const K &k) {
+        Shard &shard = shardOf(k);
+        std::unique_lock<std::mutex> _lock(shard.mutex);
+        return shard.map.erase(k);
+    }
+
+    size_type eraseIfEqual(const K &k, const V &v) {
+        return eraseIf(k, [&v](const V &value) { return value == v; });
+    }
+
+    // Erases k if pred returns true for its value.
+    template<typename Pred>
+    size_type eraseIf(const K &k, Pred pred) {
+        Shard &shard = shardOf(k);
+        std::unique_lock<std::mutex> _lock(shard.mutex);
+        auto iter = shard.map.find(k);
+        if (iter == shard.map.end() || !pred(iter->second)) {
+            return 0;
+        }
+        shard.map.erase(iter);
+        return 1;
+    }
+
+    std::unique_lock<std::mutex> lock(const K &k) {
+        return std::unique_lock<std::mutex>(shardOf(k).mutex);
+    }
+
+    void setLocked(K &&k, V &&v) {
+        Shard &shard = shardOf(k);
+        shard.map[std::forward<K>(k)] = std::forward<V>(v);
+    }
+
+    V getLocked(const K &k, const V &def) const {
+        const Shard &shard = shardOf(k);
+        auto iter = shard.map.find(k);
+        if (iter == shard.map.end()) {
+            return def;
+        }
+        return iter->second;
+    }
+
+    size_type size() const {
+        size_type size = 0;
+        for (const Shard &shard : mShards) {
+            std::unique_lock<std::mutex> _lock(shard.mutex);
+            size += shard.map.size();
+        }
+        return size;
+    }
+
+    // Calls fn(key, value) for each entry, with the lock of its shard held.
+    template<typename Fn>
+    void forEach(Fn fn) const {
+        for (const Shard &shard : mShards) {
+            std::unique_lock<std::mutex> _lock(shard.mutex);
+            for (const auto &entry : shard.map) {
+                fn(entry.first, entry.second);
+            }
+        }
+    }
+
+private:
+    static constexpr size_t kShardCount = 16;
+
+    // A cache line each, so that shards don't slow each other down.
+    struct alignas(64) Shard {
+        mutable std::mutex mutex;
+        std::unordered_map<K, V, Hash> map;
+    };
+
+    // Mixes in higher bits, which differ more than the low ones of pointers.
+    static size_t shardIndex(const K &k) {
+        size_t hash = Hash()(k);
+        return (hash ^ (hash >> 7) ^ (hash >> 13)) % kShardCount;
+    }
+
+    Shard &shardOf(const K &k) { return mShards[shardIndex(k)]; }
+    const Shard &shardOf(const K &k) const { return mShards[shardIndex(k)]; }
+
+    Shard mShards[kShardCount];
+};
+
+// Maps objects to values without keeping the objects alive. An entry is only
+// found for the object it was set for, not for a later one at the same
+// address. Entries of dead objects are only dropped by set(), once the map
+// has grown to twice its size after the previous pruning (and at least
+// kMinPruneSize). Objects that die after the last set() therefore keep
+// their entries, and the weak references in them, until the next one; the
+// map never holds more entries than it did right after that set().
+template<typename T, typename V>
+class WeakKeyedMap {
+private:
+    using size_type = size_t;
+
+public:
+    void set(const wp<T> &object, V &&value) {
+        size_type size = mSize.load();
+        if (size >= kMinPruneSize && size >= 2 * mLiveSize.load()) {
+            prune();
+        }
+        mSize += mMap.set(object.unsafe_get(), Entry{object, std::forward<V>(value)});
+    }
+
+    // get with the given default value.
+    V get(const wp<T> &object, const V &def) const {
+        Entry entry = mMap.get(object.unsafe_get(), Entry{wp<T>(), def});
+        // Not set, or set for an object that died and left its address.
+        if (entry.object.unsafe_get() == nullptr ||
+            entry.object.get_refs() != object.get_refs()) {
+            return def;
+        }
+        return entry.value;
+    }
+
+    size_type size() const {
+        return mSize.load();
+    }
+
+private:
+    static constexpr size_t kMinPruneSize = 32;
+
+    struct Entry {
+        wp<T> object;
+        V value;
+    };
+
+    // Erases the entries of dead objects. Only promotes them without a lock
+    // held, since dropping the last reference runs the object's destructor.
+    void prune() {
+        std::vector<std::pair<const T *, wp<T>>> objects;
+        mMap.forEach([&objects](const T *key, const Entry &entry) {
+            objects.emplace_back(key, entry.object);
+        });
+        for (const auto &object : objects) {
+            if (object.second.promote() == nullptr) {
+                mSize -= mMap.eraseIf(object.first, [&object](const Entry &entry) {
+                    return entry.object.get_refs() == object.second.get_refs();
+                });
+            }
+        }
+        mLiveSize = mSize.load();
+    }
+
+    ShardedConcurrentMap<const T *, Entry> mMap;
+    // Kept apart from mMap, whose size() locks every shard.
+    std::atomic<size_t> mSize{0};
+    std::atomic<size_t> mLiveSize{0};
+};
+
+// A map for lookups from many threads that is rarely written to, such as the
+// constructor maps filled in while libraries are loaded. get() takes no lock:
+// entries never change once published, and the entries and tables that a
+// set() or erase() replaces are kept until the map is destroyed, so a
+// concurrent get() never sees freed memory. Each write and each doubling of
+// the table costs a copy of the entries involved; only use this for maps that
+// grow at startup and are then read.
+template<typename K, typename V, typename Hash = std::hash<K>>
+class ReadMostlyMap {
+private:
+    using size_type = size_t;
+
+public:
+    void set(K &&k, V &&v) {
+        std::unique_lock<std::mutex> _lock(mMutex);
+        Table *table = mTable.load(std::memory_order_relaxed);
+        if (table == nullptr || (!isLive(findLocked(table, k)) &&
+                                 mSize >= table->bucketCount)) {
+            table = growLocked(table);
+        }
+        if (!isLive(findLocked(table, k))) {
+            ++mSize;
+        }
+        // Shadows any older entry for k, which is found after this one.
+        insertLocked(table, std::forward<K>(k), std::forward<V>(v), false /* erased */);
+    }
+
+    size_type erase(const K &k) {
+        std::unique_lock<std::mutex> _lock(mMutex);
+        Table *table = mTable.load(std::memory_order_relaxed);
+        if (table == nullptr || !isLive(findLocked(table, k))) {
+            return 0;
+        }
+        --mSize;
+        insertLocked(table, K(k), V(), true /* erased */);
+        return 1;
+    }
+
+    // get with the given default value. k may be of any type that Hash
+    // accepts and that compares to K.
+    template<typename Key>
+    V get(const Key &k, const V &def) const {
+        const Table *table = mTable.load(std::memory_order_acquire);
+        if (table == nullptr) {
+            return def;
+        }
+        const Node *node = table->bucket(k).load(std::memory_order_acquire);
+        for (; node != nullptr; node = node->next) {
+            if (node->key == k) {
+                return node->erased ? def : node->value;
+            }
+        }
+        return def;
+    }
+
+private:
+    static constexpr size_t kInitialBucketCount = 64;
+
+    // An erased entry is shadowed by a node with erased set.
+    struct Node {
+        Node(K &&k, V &&v, bool e, const Node *n)
+            : key(std::forward<K>(k)), value(std::forward<V>(v)), erased(e), next(n) {}
+
+        const K key;
+        const V value;
+        const bool erased;
+        const Node *const next;
+    };
+
+    static bool isLive(const Node *node) {
+        return node != nullptr && !node->erased;
+    }
+
+    struct Table {
+        explicit Table(size_t count)
+            : bucketCount(count), buckets(new std::atomic<const Node *>[count]) {
+            for (size_t i = 0; i < bucketCount; ++i) {
+                buckets[i].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        template<typename Key>
+        std::atomic<const Node *> &bucket(const Key &k) const {
+            return buckets[Hash()(k) % bucketCount];
+        }
+
+        const size_t bucketCount;
+        std::unique_ptr<std::atomic<const Node *>[]> buckets;
+    };
+
+    const Node *findLocked(const Table *table, const K &k) const {
+        const Node *node = table->bucket(k).load(std::memory_order_relaxed);
+        for (; node != nullptr; node = node->next) {
+            if (node->key == k) {
+                return node;
+            }
+        }
+        return nullptr;
+    }
+
+    void insertLocked(Table *table, K &&k, V &&v, bool erased) {
+        std::atomic<const Node *> &bucket = table->bucket(k);
+        mNodes.emplace_back(new Node(std::forward<K>(k), std::forward<V>(v), erased,
+                                     bucket.load(std::memory_order_relaxed)));
+        bucket.store(mNodes.back().get(), std::memory_order_release);
+    }
+
+    // Publishes a table with twice the buckets and a copy of the current
+    // entries of the old one.
+    Table *growLocked(const Table *old) {
+        mTables.emplace_back(new Table(old == nullptr ? kInitialBucketCount
+                                                      : old->bucketCount * 2));
+        Table *table = mTables.back().get();
+        for (size_t i = 0; old != nullptr && i < old->bucketCount; ++i) {
+            const Node *node = old->buckets[i].load(std::memory_order_relaxed);
+            for (; node != nullptr; node = node->next) {
+                // Skip entries shadowed by a newer one, and erased ones.
+                if (findLocked(old, node->key) == node && !node->erased) {
+                    insertLocked(table, K(node->key), V(node->value), false /* erased */);
+                }
+            }
+        }
+        mTable.store(table, std::memory_order_release);
+        return table;
+    }
+
+    std::mutex mMutex;
+    std::atomic<Table *> mTable{nullptr};
+    size_t mSize = 0;
+    // Everything ever published, for the readers that may still use it.
+    std::vector<std::unique_ptr<Node>> mNodes;
+    std::vector<std::unique_ptr<Table>> mTables;
+};
+
 }  // namespace hardware
 }  // namespace android
 
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ANDROID_HIDL_DESCRIPTOR_IDS_H
+#define ANDROID_HIDL_DESCRIPTOR_IDS_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <hidl/HidlSupport.h>
+
+namespace android {
+namespace hardware {
+namespace details {
+
+// A small number naming an interface descriptor for the life of the process.
+// A descriptor gets one when its constructors are registered, so that looking
+// them up later needs neither a copy of the descriptor nor string compares.
+using DescriptorId = uint32_t;
+constexpr DescriptorId kInvalidDescriptorId = 0;
+
+// Returns the id of descriptor, assigning the next free one on first use.
+DescriptorId internDescriptor(const std::string &descriptor);
+
+// Returns the id of descriptor, or kInvalidDescriptorId if it has none.
+// Takes no lock and doesn't allocate.
+DescriptorId findDescriptorId(const hidl_string &descriptor);
+DescriptorId findDescriptorId(const std::string &descriptor);
+
+// Hashes std::string and hidl_string alike, so that either finds an interned
+// descriptor.
+struct DescriptorHash {
+    size_t operator()(const std::string &s) const {
+        return hashString(s.data(), s.size());
+    }
+    size_t operator()(const hidl_string &s) const {
+        return hashString(s.c_str(), s.size());
+    }
+};
+
+// A constructor for each interface descriptor, stored at the descriptor's id.
+// get() takes no lock: the slots live in segments that never move, each twice
+// the size of the previous one, and constructors that are replaced or erased
+// are kept until the map is destroyed.
+template<typename Fn>
+class ConstructorMap {
+private:
+    using size_type = size_t;
+
+public:
+    ConstructorMap() {
+        for (size_t i = 0; i < kSegmentCount; ++i) {
+            mSegments[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    // For autogenerated code, when its library is loaded.
+    void set(std::string &&descriptor, Fn &&constructor) {
+        DescriptorId id = internDescriptor(descriptor);
+        std::unique_lock<std::mutex> _lock(mMutex);
+        mConstructors.emplace_back(new Fn(std::move(constructor)));
+        slotLocked(id).store(mConstructors.back().get(), std::memory_order_release);
+    }
+
+    // For autogenerated code, when its library is unloaded.
+    size_type erase(const std::string &descriptor) {
+        DescriptorId id = findDescriptorId(descriptor);
+        if (id == kInvalidDescriptorId) {
+            return 0;
+        }
+        std::unique_lock<std::mutex> _lock(mMutex);
+        return slotLocked(id).exchange(nullptr, std::memory_order_relaxed) != nullptr ? 1 : 0;
+    }
+
+    // get with the given default value.
+    Fn get(DescriptorId id, const Fn &def) const {
+        size_t offset;
+        const Slot *slots = mSegments[segmentOf(id, &offset)].load(std::memory_order_acquire);
+        if (slots == nullptr) {
+            return def;
+        }
+        const Fn *constructor = slots[offset].load(std::memory_order_acquire);
+        return constructor != nullptr ? *constructor : def;
+    }
+
+    Fn get(const std::string &descriptor, const Fn &def) const {
+        return get(findDescriptorId(descriptor), def);
+    }
+
+private:
+    using Slot = std::atomic<const Fn *>;
+
+    static constexpr size_t kFirstSegmentSize = 64;
+    // Enough for all DescriptorIds.
+    static constexpr size_t kSegmentCount = 27;
+
+    // Segment s holds the ids from kFirstSegmentSize * (2^s - 1) on.
+    static size_t segmentOf(DescriptorId id, size_t *offset) {
+        uint64_t blocks = id / kFirstSegmentSize + 1;
+        size_t segment = 63 - __builtin_clzll(blocks);
+        *offset = id - kFirstSegmentSize * ((uint64_t{1} << segment) - 1);
+        return segment;
+    }
+
+    Slot &slotLocked(DescriptorId id) {
+        size_t offset;
+        size_t segment = segmentOf(id, &offset);
+        Slot *slots = mSegments[segment].load(std::memory_order_relaxed);
+        if (slots == nullptr) {
+            size_t count = kFirstSegmentSize << segment;
+            mSlots.emplace_back(new Slot[count]);
+            slots = mSlots.back().get();
+            for (size_t i = 0; i < count; ++i) {
+                slots[i].store(nullptr, std::memory_order_relaxed);
+            }
+            mSegments[segment].store(slots, std::memory_order_release);
+        }
+        return slots[offset];
+    }
+
+    std::mutex mMutex;
+    std::atomic<Slot *> mSegments[kSegmentCount];
+    // Everything ever published, for the readers that may still use it.
+    std::vector<std::unique_ptr<Slot[]>> mSlots;
+    std::vector<std::unique_ptr<Fn>> mConstructors;
+};
+
+}  // namespace details
+}  // namespace hardware
+}  // namespace android
+
+#endif  // ANDROID_HIDL_DESCRIPTOR_IDS_H
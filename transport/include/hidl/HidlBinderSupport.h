@@ -301,6 +301,20 @@ static status_t writeReferenceToParcel(
 
 // ---------------------- support for casting interfaces
 
+namespace details {
+// Attached to each binder that toBinder() creates, with the interface as the
+// object and the binder as the cookie. Erases the binder's gBnMap entry when
+// it is destroyed.
+void onBnObjectDestroyed(const void* id, void* object, void* cookie);
+
+// Like canCastInterface(), for a remote interface and its binder. The
+// interface chain is fetched once for each binder and released when its death
+// notification arrives; after that, every cast calls interfaceChain() again.
+Return<bool> canCastRemoteInterface(const sp<IBinder>& binder,
+        ::android::hidl::base::V1_0::IBase* interface, const char* castTo,
+        bool emitError = false);
+}  // namespace details
+
 // Construct a smallest possible binder from the given interface.
 // If it is remote, then its remote() will be retrieved.
 // Otherwise, the smallest possible BnChild is found where IChild is a subclass of IType
@@ -316,28 +330,38 @@ sp<IBinder> toBinder(sp<IType> iface) {
         return ::android::hardware::IInterface::asBinder(
             static_cast<BpInterface<IType>*>(ifacePtr));
     } else {
-        std::string myDescriptor = details::getDescriptor(ifacePtr);
-        if (myDescriptor.empty()) {
-            // interfaceDescriptor fails
-            return nullptr;
-        }
-
         // for get + set
-        std::unique_lock<std::mutex> _lock = details::gBnMap.lock();
+        std::unique_lock<std::mutex> _lock = details::gBnMap.lock(ifacePtr);
 
         wp<BHwBinder> wBnObj = details::gBnMap.getLocked(ifacePtr, nullptr);
         sp<IBinder> sBnObj = wBnObj.promote();
+        if (sBnObj != nullptr) {
+            return sBnObj;
+        }
 
-        if (sBnObj == nullptr) {
-            auto func = details::gBnConstructorMap.get(myDescriptor, nullptr);
-            if (!func) {
-                return nullptr;
-            }
+        // Only look at the descriptor if iface doesn't have a binder yet, and
+        // without holding up the other interfaces of this shard: it calls
+        // into iface, which builds a hidl_string.
+        _lock.unlock();
+        auto func = details::gBnConstructorMap.get(details::getDescriptorId(ifacePtr), nullptr);
+        if (!func) {
+            // interfaceDescriptor fails or has no constructor
+            return nullptr;
+        }
+        _lock.lock();
 
+        // Another thread may have created the binder meanwhile.
+        wBnObj = details::gBnMap.getLocked(ifacePtr, nullptr);
+        sBnObj = wBnObj.promote();
+        if (sBnObj == nullptr) {
             sBnObj = sp<IBinder>(func(static_cast<void*>(ifacePtr)));
 
             if (sBnObj != nullptr) {
-                details::gBnMap.setLocked(ifacePtr, static_cast<BHwBinder*>(sBnObj.get()));
+                BHwBinder* bnObj = static_cast<BHwBinder*>(sBnObj.get());
+                details::gBnMap.setLocked(ifacePtr, bnObj);
+                sBnObj->attachObject(&details::gBnMap,
+                        static_cast<::android::hidl::base::V1_0::IBase*>(ifacePtr),
+                        bnObj, details::onBnObjectDestroyed);
             }
         }
 
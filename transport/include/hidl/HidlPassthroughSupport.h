@@ -34,13 +34,9 @@ sp<::android::hidl::base::V1_0::IBase> wrapPassthrough(
         // doesn't know how to handle it.
         return iface;
     }
-    std::string myDescriptor = getDescriptor(iface.get());
-    if (myDescriptor.empty()) {
-        // interfaceDescriptor fails
-        return nullptr;
-    }
-    auto func = gBsConstructorMap.get(myDescriptor, nullptr);
+    auto func = gBsConstructorMap.get(getDescriptorId(iface.get()), nullptr);
     if (!func) {
+        // interfaceDescriptor fails or has no constructor
         return nullptr;
     }
     return func(static_cast<void *>(iface.get()));
@@ -81,13 +81,23 @@ namespace details {
 // 3. !emitError, calling into parent fails.
 // Return an error Return object if:
 // 1. emitError, calling into parent fails.
+// For a remote parent, the interface chain is cached with its binder until the
+// binder's death notification arrives, so a cast made after the server died
+// but before that can still succeed, like a call made just before it died.
 template <typename IChild, typename IParent, typename BpChild>
 Return<sp<IChild>> castInterface(sp<IParent> parent, const char* childIndicator, bool emitError) {
     if (parent.get() == nullptr) {
         // casts always succeed with nullptrs.
         return nullptr;
     }
-    Return<bool> canCastRet = details::canCastInterface(parent.get(), childIndicator, emitError);
+    // TODO b/32001926 Needs to be fixed for socket mode.
+    sp<IBinder> binder;
+    if (parent->isRemote()) {
+        binder = toBinder<IParent>(parent);
+    }
+    Return<bool> canCastRet = binder != nullptr
+            ? details::canCastRemoteInterface(binder, parent.get(), childIndicator, emitError)
+            : details::canCastInterface(parent.get(), childIndicator, emitError);
     if (!canCastRet.isOk()) {
         // call fails, propagate the error if emitError
         return emitError
@@ -98,10 +108,9 @@ Return<sp<IChild>> castInterface(sp<IParent> parent, const char* childIndicator,
     if (!canCastRet) {
         return sp<IChild>(nullptr); // cast failed.
     }
-    // TODO b/32001926 Needs to be fixed for socket mode.
-    if (parent->isRemote()) {
+    if (binder != nullptr) {
         // binderized mode. Got BpChild. grab the remote and wrap it.
-        return sp<IChild>(new BpChild(toBinder<IParent>(parent)));
+        return sp<IChild>(new BpChild(binder));
     }
     // Passthrough mode. Got BnChild and BsChild.
     return sp<IChild>(static_cast<IChild *>(parent.get()));
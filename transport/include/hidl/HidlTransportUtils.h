@@ -18,6 +18,7 @@
 #define ANDROID_HIDL_TRANSPORT_UTILS_H
 
 #include <android/hidl/base/1.0/IBase.h>
+#include <hidl/DescriptorIds.h>
 
 namespace android {
 namespace hardware {
@@ -33,6 +34,13 @@ Return<bool> canCastInterface(::android::hidl::base::V1_0::IBase* interface,
 
 std::string getDescriptor(::android::hidl::base::V1_0::IBase* interface);
 
+/*
+ * Like getDescriptor(), but returns the id of the descriptor without copying
+ * it, or kInvalidDescriptorId if the call fails or no constructors have been
+ * registered for it.
+ */
+DescriptorId getDescriptorId(::android::hidl::base::V1_0::IBase* interface);
+
 }   // namespace details
 }   // namespace hardware
 }   // namespace android
@@ -18,9 +18,11 @@
 // destruction order in the library.
 
 #include <functional>
+#include <mutex>
 
 #include <android/hidl/base/1.0/IBase.h>
 #include <hidl/ConcurrentMap.h>
+#include <hidl/DescriptorIds.h>
 #include <hwbinder/IBinder.h>
 #include <hwbinder/IInterface.h>
 #include <utils/StrongPointer.h>
@@ -34,23 +36,34 @@ struct SchedPrio {
     int prio;
 };
 
-extern ConcurrentMap<wp<::android::hidl::base::V1_0::IBase>, SchedPrio> gServicePrioMap;
+// For HidlTransportSupport and autogenerated code, which reads it once for
+// each stub it creates.
+extern WeakKeyedMap<::android::hidl::base::V1_0::IBase, SchedPrio> gServicePrioMap;
 
-// For HidlBinderSupport and autogenerated code
-extern ConcurrentMap<const ::android::hidl::base::V1_0::IBase*, wp<::android::hardware::BHwBinder>>
+// For DescriptorIds. Only written with gDescriptorIdsLock held.
+extern std::mutex gDescriptorIdsLock;
+extern ReadMostlyMap<std::string, DescriptorId, DescriptorHash> gDescriptorIds;
+extern DescriptorId gLastDescriptorId;
+
+// For HidlBinderSupport, to attach one interface chain cache to each binder.
+extern std::mutex gInterfaceChainLock;
+
+// For HidlBinderSupport and autogenerated code. Entries are erased when their
+// binder is destroyed.
+extern ShardedConcurrentMap<const ::android::hidl::base::V1_0::IBase*,
+                            wp<::android::hardware::BHwBinder>>
     gBnMap;
 
 // For HidlBinderSupport and autogenerated code
 // value function receives reinterpret_cast<void *>(static_cast<IFoo *>(foo)),
 // returns sp<IBinder>
-extern ConcurrentMap<std::string,
-        std::function<sp<IBinder>(void *)>> gBnConstructorMap;
+extern ConstructorMap<std::function<sp<IBinder>(void *)>> gBnConstructorMap;
 
 // For HidlPassthroughSupport and autogenerated code
 // value function receives reinterpret_cast<void *>(static_cast<IFoo *>(foo)),
 // returns sp<IBase>
-extern ConcurrentMap<std::string,
-        std::function<sp<::android::hidl::base::V1_0::IBase>(void *)>> gBsConstructorMap;
+extern ConstructorMap<std::function<sp<::android::hidl::base::V1_0::IBase>(void *)>>
+        gBsConstructorMap;
 
 }  // namespace details
 }  // namespace hardware